@@ -5,9 +5,31 @@
             "sources": [
                 "src/common.cpp",
                 "src/png_encoder.cpp",
+                "src/file_sink.cpp",
+                "src/memory_sink.cpp",
                 "src/png.cpp",
+                "src/png_read_stream.cpp",
+                "src/png_encode_stream.cpp",
+                "src/png_reader.cpp",
+                "src/png_decoder.cpp",
+                "src/png_probe.cpp",
                 "src/fixed_png_stack.cpp",
                 "src/dynamic_png_stack.cpp",
+                "src/skyline_packer.cpp",
+                "src/color_key.cpp",
+                "src/palette.cpp",
+                "src/color_analysis.cpp",
+                "src/quantizer.cpp",
+                "src/encoder_session.cpp",
+                "src/pixel_packer.cpp",
+                "src/png_filter.cpp",
+                "src/size_estimator.cpp",
+                "src/frame_diff.cpp",
+                "src/motion_detect.cpp",
+                "src/hash.cpp",
+                "src/png_cache.cpp",
+                "src/buffer_pool.cpp",
+                "src/banded_encoder.cpp",
                 "src/module.cpp",
                 "src/buffer_compat.cpp",
             ],
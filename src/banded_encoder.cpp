@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "banded_encoder.h"
+#include "frame_diff.h"
+#include "pixel_packer.h"
+#include "png_filter.h"
+
+BandedEncoder::BandedEncoder() :
+    width(0), height(0), bits(0), band_rows(0), level(-1), buf_type(BUF_RGB), little_endian(false) {}
+
+void
+BandedEncoder::reset()
+{
+    width = height = 0;
+    frame.clear();
+    bands.clear();
+}
+
+static int
+png_color_type(buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_GRAY: return 0;
+    case BUF_GRAYA: return 4;
+    case BUF_RGB: case BUF_BGR: return 2;
+    default: return 6;
+    }
+}
+
+// Turns a row of the input buffer into PNG samples: big endian, RGB order
+// and alpha the right way around (the input's is inverted).
+void
+BandedEncoder::prepare_row(const unsigned char *src, unsigned char *dst) const
+{
+    int sample = bits/8;
+    int bpp = bytes_per_pixel(buf_type, bits);
+    int row_len = width*bpp;
+
+    if (bits == 16 && little_endian)
+        swap_bytes16(src, dst, row_len/2);
+    else
+        memcpy(dst, src, row_len);
+
+    if (buf_type == BUF_BGR || buf_type == BUF_BGRA) {
+        for (unsigned char *p = dst; p < dst + row_len; p += bpp) {
+            for (int i = 0; i < sample; i++) {
+                unsigned char t = p[i];
+                p[i] = p[2*sample + i];
+                p[2*sample + i] = t;
+            }
+        }
+    }
+    if (buf_type == BUF_RGBA || buf_type == BUF_BGRA || buf_type == BUF_GRAYA) {
+        for (unsigned char *p = dst + bpp - sample; p < dst + row_len; p += bpp) {
+            for (int i = 0; i < sample; i++)
+                p[i] = ~p[i];
+        }
+    }
+}
+
+// Filters and deflates rows y0 to y1 into band, ending with a full flush.
+void
+BandedEncoder::deflate_band(const unsigned char *data, int stride, int y0, int y1,
+    Band &band) const
+{
+    int bpp = bytes_per_pixel(buf_type, bits);
+    int row_len = width*bpp;
+    std::vector<unsigned char> prev(row_len), cur(row_len), scratch(row_len);
+    std::vector<unsigned char> filtered((long)(y1 - y0)*(row_len + 1));
+
+    if (y0 > 0)
+        prepare_row(data + (long)(y0 - 1)*stride, &prev[0]);
+    for (int y = y0; y < y1; y++) {
+        prepare_row(data + (long)y*stride, &cur[0]);
+        filter_row(&cur[0], y > 0 ? &prev[0] : NULL, row_len, bpp,
+            &filtered[(long)(y - y0)*(row_len + 1)], &scratch[0]);
+        cur.swap(prev);
+    }
+
+    band.raw_len = filtered.size();
+    band.adler = adler32(adler32(0L, Z_NULL, 0), &filtered[0], filtered.size());
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int zlevel = level < 0 ? Z_DEFAULT_COMPRESSION : level;
+    if (deflateInit2(&zs, zlevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw "deflateInit2 failed in node-png (BandedEncoder::deflate_band).";
+
+    band.deflated.resize(deflateBound(&zs, filtered.size()) + 16);
+    zs.next_in = &filtered[0];
+    zs.avail_in = filtered.size();
+    zs.next_out = &band.deflated[0];
+    zs.avail_out = band.deflated.size();
+    while (deflate(&zs, Z_FULL_FLUSH) == Z_OK && zs.avail_out == 0) {
+        size_t done = band.deflated.size();
+        band.deflated.resize(done*2);
+        zs.next_out = &band.deflated[done];
+        zs.avail_out = band.deflated.size() - done;
+    }
+    band.deflated.resize(zs.total_out);
+    deflateEnd(&zs);
+}
+
+static void
+put32(std::vector<unsigned char> &out, uLong v)
+{
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+static void
+put_chunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data,
+    size_t len)
+{
+    put32(out, len);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (len)
+        out.insert(out.end(), data, data + len);
+    put32(out, crc32(crc32(0L, Z_NULL, 0), &out[start], len + 4));
+}
+
+// Encodes the buffer into png reusing the bands that didn't change since the
+// previous call. Returns the number of reused bands. New bands are deflated
+// with level, -1 for zlib's default. trns is the red, green and blue of the
+// color made transparent with tRNS, or NULL.
+int
+BandedEncoder::encode(const unsigned char *data, int wwidth, int hheight, int stride,
+    buffer_type bbuf_type, int bbits, bool llittle_endian, int bband_rows, int llevel,
+    const unsigned short *trns, std::vector<unsigned char> &png)
+{
+    if (wwidth != width || hheight != height || bbuf_type != buf_type || bbits != bits ||
+        llittle_endian != little_endian || bband_rows != band_rows)
+    {
+        reset();
+        width = wwidth;
+        height = hheight;
+        buf_type = bbuf_type;
+        bits = bbits;
+        little_endian = llittle_endian;
+        band_rows = bband_rows;
+    }
+    level = llevel;
+
+    int row_len = width*bytes_per_pixel(buf_type, bits);
+    bool have_prev = !frame.empty();
+    std::vector<unsigned char> same(height, 0);
+    if (have_prev) {
+        for (int y = 0; y < height; y++) {
+            same[y] = bytes_equal(data + (long)y*stride, &frame[(long)y*row_len], row_len);
+        }
+    }
+
+    int band_count = (height + band_rows - 1)/band_rows;
+    int reused = 0;
+    try {
+        bands.resize(band_count);
+        for (int b = 0; b < band_count; b++) {
+            int y0 = b*band_rows, y1 = std::min(height, y0 + band_rows);
+            bool unchanged = have_prev && (y0 == 0 || same[y0 - 1]);
+            for (int y = y0; y < y1 && unchanged; y++)
+                unchanged = same[y];
+            if (unchanged) {
+                reused++;
+                continue;
+            }
+            deflate_band(data, stride, y0, y1, bands[b]);
+        }
+
+        frame.resize((long)height*row_len);
+    }
+    catch (...) {
+        // Some bands may already hold the new rows while frame still has
+        // the old ones, the next encode would reuse them wrongly.
+        reset();
+        throw;
+    }
+    for (int y = 0; y < height; y++) {
+        if (!same[y])
+            memcpy(&frame[(long)y*row_len], data + (long)y*stride, row_len);
+    }
+
+    // zlib header, the bands, an empty final block and the adler32 of it all.
+    std::vector<unsigned char> idat;
+    idat.push_back(0x78);
+    idat.push_back(0x9C);
+    uLong adler = adler32(0L, Z_NULL, 0);
+    for (int b = 0; b < band_count; b++) {
+        idat.insert(idat.end(), bands[b].deflated.begin(), bands[b].deflated.end());
+        adler = adler32_combine(adler, bands[b].adler, bands[b].raw_len);
+    }
+    idat.push_back(0x03);
+    idat.push_back(0x00);
+    put32(idat, adler);
+
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    png.assign(signature, signature + 8);
+
+    unsigned char ihdr[13];
+    ihdr[0] = width >> 24; ihdr[1] = width >> 16; ihdr[2] = width >> 8; ihdr[3] = width;
+    ihdr[4] = height >> 24; ihdr[5] = height >> 16; ihdr[6] = height >> 8; ihdr[7] = height;
+    ihdr[8] = bits;
+    ihdr[9] = png_color_type(buf_type);
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    put_chunk(png, "IHDR", ihdr, sizeof(ihdr));
+
+    if (trns && png_color_type(buf_type) == 2) {
+        unsigned char t[6];
+        for (int i = 0; i < 3; i++) {
+            t[2*i] = trns[i] >> 8;
+            t[2*i + 1] = trns[i];
+        }
+        put_chunk(png, "tRNS", t, sizeof(t));
+    }
+
+    put_chunk(png, "IDAT", &idat[0], idat.size());
+    put_chunk(png, "IEND", NULL, 0);
+    return reused;
+}
@@ -0,0 +1,41 @@
+#ifndef BANDED_ENCODER_H
+#define BANDED_ENCODER_H
+
+#include <zlib.h>
+
+#include <vector>
+
+#include "common.h"
+
+// Writes PNGs with its own IDAT writer so that the deflate output of bands
+// of rows can be kept and reused by the next frame. Every band is deflated
+// on its own and ends with a full flush, which makes the compressed bands
+// independent of each other. Bands whose rows didn't change (and whose
+// first row's filter sees the same row above) are copied from the previous
+// frame and the zlib checksum is put together with adler32_combine.
+class BandedEncoder {
+    struct Band {
+        std::vector<unsigned char> deflated;
+        uLong adler;
+        uLong raw_len;
+    };
+
+    int width, height, bits, band_rows, level;
+    buffer_type buf_type;
+    bool little_endian;
+    std::vector<unsigned char> frame;   // the previous input, packed
+    std::vector<Band> bands;
+
+    void prepare_row(const unsigned char *src, unsigned char *dst) const;
+    void deflate_band(const unsigned char *data, int stride, int y0, int y1, Band &band) const;
+
+public:
+    BandedEncoder();
+
+    int encode(const unsigned char *data, int wwidth, int hheight, int stride,
+        buffer_type bbuf_type, int bbits, bool llittle_endian, int bband_rows, int llevel,
+        const unsigned short *trns, std::vector<unsigned char> &png);
+    void reset();
+};
+
+#endif
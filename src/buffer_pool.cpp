@@ -0,0 +1,213 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "buffer_pool.h"
+#include "common.h"
+
+using namespace v8;
+
+// Class i holds buffers of MIN_CLASS << i bytes, bigger ones aren't pooled.
+static const size_t MIN_CLASS = 4096;
+static const int CLASSES = 15;                  // up to 64M
+static const size_t MAX_POOLED = 64*1024*1024;  // bytes kept for reuse
+
+// In front of every buffer, 16 bytes to keep the data aligned.
+union Header {
+    struct {
+        size_t capacity;
+        int size_class;     // -1 if not pooled
+    } h;
+    double align[2];
+};
+
+static uv_mutex_t lock;
+static void *free_lists[CLASSES];  // linked through the first bytes of the data
+static size_t pooled, in_use, peak, reported;
+static double hits, misses;
+
+void
+BufferPool::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    uv_mutex_init(&lock);
+    NODE_SET_METHOD(target, "bufferPoolStats", Stats);
+    NODE_SET_METHOD(target, "trimBufferPool", Trim);
+}
+
+static Header *
+header(const void *p)
+{
+    return (Header *)p - 1;
+}
+
+void *
+BufferPool::allocate(size_t size)
+{
+    int size_class = 0;
+    while (size_class < CLASSES && (MIN_CLASS << size_class) < size)
+        size_class++;
+    if (size_class == CLASSES)
+        size_class = -1;
+    size_t cap = size_class == -1 ? size : MIN_CLASS << size_class;
+
+    uv_mutex_lock(&lock);
+    void *p = NULL;
+    if (size_class != -1 && free_lists[size_class]) {
+        p = free_lists[size_class];
+        memcpy(&free_lists[size_class], p, sizeof(void *));
+        pooled -= cap;
+        hits++;
+    }
+    else {
+        misses++;
+    }
+    in_use += cap;
+    if (in_use > peak)
+        peak = in_use;
+    uv_mutex_unlock(&lock);
+
+    if (p)
+        return p;
+
+    Header *hdr = (Header *)malloc(sizeof(Header) + cap);
+    if (!hdr) {
+        uv_mutex_lock(&lock);
+        in_use -= cap;
+        uv_mutex_unlock(&lock);
+        throw "malloc failed in node-png (BufferPool::allocate).";
+    }
+    hdr->h.capacity = cap;
+    hdr->h.size_class = size_class;
+    return hdr + 1;
+}
+
+// Grows p to at least size, keeping its contents. Sizes go up a class at a
+// time, so growing by small steps is cheap. Past the largest class buffers
+// grow by half at least, in place with realloc once they're unpooled.
+void *
+BufferPool::reallocate(void *p, size_t size)
+{
+    if (!p)
+        return allocate(size);
+    size_t cap = header(p)->h.capacity;
+    if (size <= cap)
+        return p;
+
+    if (size > MIN_CLASS << (CLASSES - 1)) {
+        size = std::max(size, cap + cap/2);
+        size = (size + MIN_CLASS - 1) & ~(MIN_CLASS - 1);
+
+        if (header(p)->h.size_class == -1) {
+            Header *hdr = (Header *)realloc(header(p), sizeof(Header) + size);
+            if (!hdr)
+                throw "realloc failed in node-png (BufferPool::reallocate).";
+            hdr->h.capacity = size;
+
+            uv_mutex_lock(&lock);
+            in_use += size - cap;
+            if (in_use > peak)
+                peak = in_use;
+            uv_mutex_unlock(&lock);
+            return hdr + 1;
+        }
+    }
+
+    void *np = allocate(size);
+    memcpy(np, p, cap);
+    release(p);
+    return np;
+}
+
+void
+BufferPool::release(void *p)
+{
+    if (!p)
+        return;
+
+    Header *hdr = header(p);
+    size_t cap = hdr->h.capacity;
+    int size_class = hdr->h.size_class;
+
+    uv_mutex_lock(&lock);
+    in_use -= cap;
+    bool keep = size_class != -1 && pooled + cap <= MAX_POOLED;
+    if (keep) {
+        memcpy(p, &free_lists[size_class], sizeof(void *));
+        free_lists[size_class] = p;
+        pooled += cap;
+    }
+    uv_mutex_unlock(&lock);
+
+    if (!keep)
+        free(hdr);
+}
+
+size_t
+BufferPool::capacity(const void *p)
+{
+    return header(p)->h.capacity;
+}
+
+// Gives all pooled buffers back to malloc.
+void
+BufferPool::trim()
+{
+    uv_mutex_lock(&lock);
+    for (int i = 0; i < CLASSES; i++) {
+        void *p = free_lists[i];
+        while (p) {
+            void *next;
+            memcpy(&next, p, sizeof(void *));
+            free(header(p));
+            p = next;
+        }
+        free_lists[i] = NULL;
+    }
+    pooled = 0;
+    uv_mutex_unlock(&lock);
+}
+
+// Tells V8 how the memory held by the pool changed since the last call.
+void
+BufferPool::report_external()
+{
+    uv_mutex_lock(&lock);
+    size_t held = pooled + in_use;
+    long delta = (long)held - (long)reported;
+    reported = held;
+    uv_mutex_unlock(&lock);
+
+    if (delta)
+        V8::AdjustAmountOfExternalAllocatedMemory(delta);
+}
+
+Handle<Value>
+BufferPool::Stats(const Arguments &args)
+{
+    HandleScope scope;
+
+    report_external();
+
+    uv_mutex_lock(&lock);
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("pooled"), Number::New(pooled));
+    stats->Set(String::NewSymbol("inUse"), Number::New(in_use));
+    stats->Set(String::NewSymbol("peak"), Number::New(peak));
+    stats->Set(String::NewSymbol("hits"), Number::New(hits));
+    stats->Set(String::NewSymbol("misses"), Number::New(misses));
+    uv_mutex_unlock(&lock);
+
+    return scope.Close(stats);
+}
+
+Handle<Value>
+BufferPool::Trim(const Arguments &args)
+{
+    HandleScope scope;
+
+    trim();
+    report_external();
+    return Undefined();
+}
@@ -0,0 +1,29 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <node.h>
+
+#include <cstddef>
+
+// Size-classed pool for the big native buffers: encoder output, stack
+// canvases and the copies DynamicPngStack keeps. Freed buffers are kept for
+// reuse up to a limit instead of going back to malloc. Everything the pool
+// holds is reported to V8 as external memory with report_external(), which
+// has to be called on the loop thread - after async encodes and in the sync
+// ones. The other functions can be called from any thread.
+class BufferPool {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+
+    static void *allocate(size_t size);
+    static void *reallocate(void *p, size_t size);
+    static void release(void *p);
+    static size_t capacity(const void *p);
+    static void trim();
+    static void report_external();
+
+    static v8::Handle<v8::Value> Stats(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Trim(const v8::Arguments &args);
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "color_analysis.h"
+
+// Alpha is the last byte of each pixel, bpp is 2 (gray+alpha) or 4.
+static bool
+is_opaque(const unsigned char *data, long pixels, int bpp)
+{
+    long i = 0;
+#ifdef __SSE2__
+    const int step = 16/bpp;
+    const __m128i alpha = bpp == 4 ? _mm_set1_epi32(0xFF000000) : _mm_set1_epi16((short)0xFF00);
+    __m128i acc = _mm_setzero_si128();
+    for (; i + step <= pixels; i += step) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i*bpp));
+        acc = _mm_or_si128(acc, _mm_and_si128(v, alpha));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+        return false;
+#endif
+    for (; i < pixels; i++) {
+        if (data[i*bpp + bpp - 1])
+            return false;
+    }
+    return true;
+}
+
+static bool
+is_gray4(const unsigned char *data, long pixels)
+{
+    long i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= pixels; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i*4));
+        __m128i eq = _mm_cmpeq_epi8(v, _mm_srli_epi32(v, 8));
+        if ((_mm_movemask_epi8(eq) & 0x3333) != 0x3333)
+            return false;
+    }
+#endif
+    for (; i < pixels; i++) {
+        const unsigned char *p = data + i*4;
+        if (p[0] != p[1] || p[1] != p[2])
+            return false;
+    }
+    return true;
+}
+
+static bool
+is_gray3(const unsigned char *data, long pixels)
+{
+    long i = 0;
+#ifdef __SSE2__
+    // Compare every byte with the next one, 16 pixels (48 bytes) at a time.
+    // Only the first two bytes of each pixel matter, the masks select them
+    // for each of the three 16 byte blocks.
+    static const int masks[3] = { 0xB6DB, 0xDB6D, 0x6DB6 };
+    for (; i + 17 <= pixels; i += 16) {
+        const unsigned char *p = data + i*3;
+        for (int k = 0; k < 3; k++) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(p + k*16));
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + k*16 + 1));
+            if ((_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & masks[k]) != masks[k])
+                return false;
+        }
+    }
+#endif
+    for (; i < pixels; i++) {
+        const unsigned char *p = data + i*3;
+        if (p[0] != p[1] || p[1] != p[2])
+            return false;
+    }
+    return true;
+}
+
+// Finds out whether an 8 bit buffer could be written with a cheaper color
+// type without losing anything. If the buffer has at most 256 colors they
+// are left in palette. color_key is the packed color (see pack_pixel) made
+// transparent with tRNS, if any.
+void
+analyze_colors(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, const unsigned int *color_key, Palette &palette,
+    ColorAnalysis &result)
+{
+    // Packed buffers are checked in one go, padded ones a row at a time.
+    int rows = height;
+    long row_pixels = width;
+    if (stride == width*bytes_per_pixel(buf_type, 8)) {
+        rows = height > 0 ? 1 : 0;
+        row_pixels = (long)width*height;
+    }
+
+    result.opaque = true;
+    result.gray = true;
+    for (int y = 0; y < rows; y++) {
+        const unsigned char *row = data + (long)y*stride;
+        switch (buf_type) {
+        case BUF_RGBA:
+        case BUF_BGRA:
+            result.opaque = result.opaque && is_opaque(row, row_pixels, 4);
+            result.gray = result.gray && is_gray4(row, row_pixels);
+            break;
+        case BUF_GRAYA:
+            result.opaque = result.opaque && is_opaque(row, row_pixels, 2);
+            break;
+        case BUF_RGB:
+        case BUF_BGR:
+            result.gray = result.gray && is_gray3(row, row_pixels);
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (palette.build(data, width, height, stride, buf_type, color_key))
+        result.colors = palette.size();
+    else
+        result.colors = -1;
+}
+
@@ -0,0 +1,18 @@
+#ifndef COLOR_ANALYSIS_H
+#define COLOR_ANALYSIS_H
+
+#include "common.h"
+#include "palette.h"
+
+struct ColorAnalysis {
+    bool opaque;    // no pixel has any alpha (alpha bytes are all 0x00)
+    bool gray;      // r == g == b for every pixel
+    int colors;     // number of distinct colors, or -1 if more than 256
+};
+
+void analyze_colors(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, const unsigned int *color_key, Palette &palette,
+    ColorAnalysis &result);
+
+#endif
+
@@ -0,0 +1,146 @@
+#include <cstdlib>
+
+#include "color_key.h"
+
+CoverageMask::CoverageMask(int wwidth, int hheight) :
+    width(wwidth), height(hheight), bits(((long)wwidth*hheight + 7)/8, 0) {}
+
+void
+CoverageMask::add(int x, int y, int w, int h)
+{
+    for (int i = y; i < y + h; i++) {
+        long start = (long)i*width + x, end = start + w;
+        for (; start < end && (start & 7); start++)
+            bits[start >> 3] |= 1 << (start & 7);
+        long whole = (end - start) >> 3;
+        if (whole > 0) {
+            memset(&bits[start >> 3], 0xFF, whole);
+            start += whole << 3;
+        }
+        for (; start < end; start++)
+            bits[start >> 3] |= 1 << (start & 7);
+    }
+}
+
+bool
+CoverageMask::is_covered(int x, int y) const
+{
+    long i = (long)y*width + x;
+    return bits[i >> 3] & (1 << (i & 7));
+}
+
+bool
+CoverageMask::is_full() const
+{
+    long n = (long)width*height;
+    for (long i = 0; i < n >> 3; i++) {
+        if (bits[i] != 0xFF)
+            return false;
+    }
+    for (long i = n & ~7L; i < n; i++) {
+        if (!(bits[i >> 3] & (1 << (i & 7))))
+            return false;
+    }
+    return true;
+}
+
+// Whether every pixel of rect has been pushed to.
+bool
+CoverageMask::covers(const Rect &rect) const
+{
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        for (int x = rect.x; x < rect.x + rect.w; x++) {
+            if (!is_covered(x, y))
+                return false;
+        }
+    }
+    return true;
+}
+
+const unsigned char INITIAL_COLOR_KEY[3] = { 0xFF, 0x00, 0xFE };
+
+void
+clear_canvas(unsigned char *data, long pixels, int bpp)
+{
+    if (bpp != 3) {
+        memset(data, 0xFF, pixels*bpp);
+        return;
+    }
+    for (long i = 0; i < pixels; i++, data += 3) {
+        data[0] = INITIAL_COLOR_KEY[0];
+        data[1] = INITIAL_COLOR_KEY[1];
+        data[2] = INITIAL_COLOR_KEY[2];
+    }
+}
+
+static inline unsigned int
+rgb_key(const unsigned char *p)
+{
+    return (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+// Makes sure the 3 byte color in key isn't used by any covered pixel of the
+// RGB canvas in data. If it is, the next free color after it is taken and all
+// the uncovered pixels are repainted with it. The uncovered pixels must
+// already hold key.
+void
+pick_color_key(unsigned char *data, int width, int height,
+    const CoverageMask &mask, unsigned char *key)
+{
+    unsigned int cur = rgb_key(key);
+    bool clash = false;
+    for (int y = 0; y < height && !clash; y++) {
+        unsigned char *p = data + (long)y*width*3;
+        for (int x = 0; x < width; x++, p += 3) {
+            if (rgb_key(p) == cur && mask.is_covered(x, y)) {
+                clash = true;
+                break;
+            }
+        }
+    }
+    if (!clash)
+        return;
+
+    // One bit for each of the 2^24 colors.
+    unsigned char *used = (unsigned char *)calloc(1 << 21, 1);
+    if (!used)
+        throw "calloc failed in node-png (pick_color_key).";
+
+    for (int y = 0; y < height; y++) {
+        unsigned char *p = data + (long)y*width*3;
+        for (int x = 0; x < width; x++, p += 3) {
+            if (mask.is_covered(x, y)) {
+                unsigned int c = rgb_key(p);
+                used[c >> 3] |= 1 << (c & 7);
+            }
+        }
+    }
+
+    // The search starts right after the old key rather than at black, which
+    // real pixels have a lot of.
+    unsigned int c = cur;
+    bool found = false;
+    for (unsigned int n = 0; n < (1U << 24) && !found; n++) {
+        c = (c + 1) & 0xFFFFFF;
+        found = !(used[c >> 3] & (1 << (c & 7)));
+    }
+    free(used);
+    if (!found)
+        throw "No free color left for the transparency key.";
+
+    key[0] = c >> 16;
+    key[1] = c >> 8;
+    key[2] = c;
+
+    for (int y = 0; y < height; y++) {
+        unsigned char *p = data + (long)y*width*3;
+        for (int x = 0; x < width; x++, p += 3) {
+            if (!mask.is_covered(x, y)) {
+                p[0] = key[0];
+                p[1] = key[1];
+                p[2] = key[2];
+            }
+        }
+    }
+}
+
@@ -0,0 +1,34 @@
+#ifndef COLOR_KEY_H
+#define COLOR_KEY_H
+
+#include <vector>
+
+#include "common.h"
+
+// Remembers which pixels of a canvas have been pushed to, so that the rest
+// can be made transparent with a tRNS color key on RGB canvases.
+class CoverageMask {
+    int width, height;
+    std::vector<unsigned char> bits;
+
+public:
+    CoverageMask(int wwidth, int hheight);
+
+    void add(int x, int y, int w, int h);
+    bool is_covered(int x, int y) const;
+    bool is_full() const;
+    bool covers(const Rect &rect) const;
+};
+
+// The key RGB canvases start with, a color pushed pixels are unlikely to have.
+extern const unsigned char INITIAL_COLOR_KEY[3];
+
+// Fills a new canvas of bpp bytes per pixel, RGB ones with INITIAL_COLOR_KEY
+// and the rest with 0xFF.
+void clear_canvas(unsigned char *data, long pixels, int bpp);
+
+void pick_color_key(unsigned char *data, int width, int height,
+    const CoverageMask &mask, unsigned char *key);
+
+#endif
+
@@ -1,6 +1,10 @@
 #include <cstdlib>
 #include <cassert>
+#include <climits>
+#include <png.h>
 #include "common.h"
+#include "encoder_session.h"
+#include "png_cache.h"
 
 using namespace v8;
 
@@ -17,8 +21,312 @@ VException(const char *msg) {
     return ThrowException(ErrorException(msg));
 }
 
+// Calls obj's handler property (ondata, onend, ...) if it's set. Used by the
+// streams, which aren't EventEmitters.
+void
+call_handler(Handle<Object> obj, const char *name, int argc, Handle<Value> *argv)
+{
+    Local<Value> fn = obj->Get(String::NewSymbol(name));
+    if (!fn->IsFunction())
+        return;
+
+    TryCatch try_catch;
+
+    Local<Function>::Cast(fn)->Call(obj, argc, argv);
+
+    if (try_catch.HasCaught())
+        node::FatalException(try_catch);
+}
+
 bool str_eq(const char *s1, const char *s2)
 {
     return strcmp(s1, s2) == 0;
 }
 
+int
+bytes_per_pixel(buffer_type buf_type, int bits)
+{
+    switch (buf_type) {
+    case BUF_GRAY:
+        return bits/8;
+    case BUF_GRAYA:
+        return 2*bits/8;
+    case BUF_RGB:
+    case BUF_BGR:
+        return 3*bits/8;
+    default:
+        return 4*bits/8;
+    }
+}
+
+// Bytes in a row of w pixels, -1 if that's more than an int holds.
+int
+row_length(int w, int bpp)
+{
+    uint64_t len = (uint64_t)w*bpp;
+    return len > INT_MAX ? -1 : (int)len;
+}
+
+// Whether h rows of row_len bytes, stride bytes apart, fit in len bytes.
+bool
+rows_fit(size_t len, int h, int stride, int row_len)
+{
+    return h == 0 || (uint64_t)stride*(h-1) + row_len <= len;
+}
+
+// 'rgb', 'bgr', 'rgba', 'bgra', 'gray' or 'graya'.
+bool
+parse_buffer_type(const char *name, buffer_type &buf_type)
+{
+    if (str_eq(name, "rgb"))
+        buf_type = BUF_RGB;
+    else if (str_eq(name, "bgr"))
+        buf_type = BUF_BGR;
+    else if (str_eq(name, "rgba"))
+        buf_type = BUF_RGBA;
+    else if (str_eq(name, "bgra"))
+        buf_type = BUF_BGRA;
+    else if (str_eq(name, "gray"))
+        buf_type = BUF_GRAY;
+    else if (str_eq(name, "graya"))
+        buf_type = BUF_GRAYA;
+    else
+        return false;
+    return true;
+}
+
+// Name of a PNG color type, as encodeInfo() and the decoder report it.
+const char *
+color_type_name(int color_type)
+{
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY: return "gray";
+    case PNG_COLOR_TYPE_GRAY_ALPHA: return "graya";
+    case PNG_COLOR_TYPE_PALETTE: return "palette";
+    case PNG_COLOR_TYPE_RGB: return "rgb";
+    default: return "rgba";
+    }
+}
+
+const char *
+parse_encode_options(Handle<Value> val, encode_options &opts)
+{
+    HandleScope scope;
+
+    opts = encode_options();
+    if (val->IsUndefined())
+        return NULL;
+    if (!val->IsObject())
+        return "Encode options must be an object.";
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> reduce = obj->Get(String::NewSymbol("reduce"));
+    if (!reduce->IsUndefined()) {
+        if (!reduce->IsBoolean())
+            return "Option 'reduce' must be true or false.";
+        opts.reduce = reduce->BooleanValue();
+    }
+
+    Local<Value> palette = obj->Get(String::NewSymbol("palette"));
+    if (!palette->IsUndefined()) {
+        if (!palette->IsBoolean())
+            return "Option 'palette' must be true or false.";
+        opts.palette = palette->BooleanValue();
+    }
+
+    Local<Value> bit_depth = obj->Get(String::NewSymbol("bitDepth"));
+    if (!bit_depth->IsUndefined()) {
+        int d = bit_depth->IsInt32() ? bit_depth->Int32Value() : 0;
+        if (d != 1 && d != 2 && d != 4 && d != 8)
+            return "Option 'bitDepth' must be 1, 2, 4 or 8.";
+        opts.bit_depth = d;
+    }
+
+    Local<Value> byte_order = obj->Get(String::NewSymbol("byteOrder"));
+    if (!byte_order->IsUndefined()) {
+        if (!byte_order->IsString())
+            return "Option 'byteOrder' must be 'big' or 'little'.";
+        String::AsciiValue bo(byte_order);
+        if (!(str_eq(*bo, "big") || str_eq(*bo, "little")))
+            return "Option 'byteOrder' must be 'big' or 'little'.";
+        opts.little_endian = str_eq(*bo, "little");
+    }
+
+    Local<Value> session = obj->Get(String::NewSymbol("session"));
+    if (!session->IsUndefined()) {
+        if (!EncoderSession::HasInstance(session))
+            return "Option 'session' must be an EncoderSession.";
+        opts.session = node::ObjectWrap::Unwrap<EncoderSession>(session->ToObject());
+    }
+
+    Local<Value> level = obj->Get(String::NewSymbol("level"));
+    if (!level->IsUndefined()) {
+        if (!level->IsInt32() || level->Int32Value() < 0 || level->Int32Value() > 9)
+            return "Option 'level' must be an integer from 0 to 9.";
+        opts.level = level->Int32Value();
+    }
+
+    Local<Value> band_rows = obj->Get(String::NewSymbol("bandRows"));
+    if (!band_rows->IsUndefined()) {
+        if (!band_rows->IsInt32() || band_rows->Int32Value() < 1)
+            return "Option 'bandRows' must be a positive integer.";
+        opts.band_rows = band_rows->Int32Value();
+    }
+
+    Local<Value> cache = obj->Get(String::NewSymbol("cache"));
+    if (!cache->IsUndefined()) {
+        if (!PngCache::HasInstance(cache))
+            return "Option 'cache' must be a PngCache.";
+        opts.cache = node::ObjectWrap::Unwrap<PngCache>(cache->ToObject());
+    }
+
+    Local<Value> quantize = obj->Get(String::NewSymbol("quantize"));
+    if (quantize->IsBoolean()) {
+        opts.quantize = quantize->BooleanValue();
+    }
+    else if (quantize->IsObject()) {
+        Local<Object> q = quantize->ToObject();
+        opts.quantize = true;
+
+        Local<Value> colors = q->Get(String::NewSymbol("colors"));
+        if (!colors->IsUndefined()) {
+            if (!colors->IsInt32() || colors->Int32Value() < 2 || colors->Int32Value() > 256)
+                return "Option 'quantize.colors' must be an integer from 2 to 256.";
+            opts.quant_colors = colors->Int32Value();
+        }
+        Local<Value> quality = q->Get(String::NewSymbol("quality"));
+        if (!quality->IsUndefined()) {
+            if (!quality->IsInt32() || quality->Int32Value() < 0 || quality->Int32Value() > 100)
+                return "Option 'quantize.quality' must be an integer from 0 to 100.";
+            opts.quant_quality = quality->Int32Value();
+        }
+        Local<Value> dither = q->Get(String::NewSymbol("dither"));
+        if (!dither->IsUndefined()) {
+            if (!dither->IsBoolean())
+                return "Option 'quantize.dither' must be true or false.";
+            opts.quant_dither = dither->BooleanValue();
+        }
+        Local<Value> iterations = q->Get(String::NewSymbol("iterations"));
+        if (!iterations->IsUndefined()) {
+            if (!iterations->IsInt32() || iterations->Int32Value() < 0)
+                return "Option 'quantize.iterations' must be a non-negative integer.";
+            opts.quant_iterations = iterations->Int32Value();
+        }
+        Local<Value> time = q->Get(String::NewSymbol("time"));
+        if (!time->IsUndefined()) {
+            if (!time->IsInt32() || time->Int32Value() < 0)
+                return "Option 'quantize.time' must be a non-negative integer (milliseconds).";
+            opts.quant_time = time->Int32Value();
+        }
+    }
+    else if (!quantize->IsUndefined()) {
+        return "Option 'quantize' must be true, false or an object.";
+    }
+
+    if (opts.band_rows) {
+        if (!opts.session)
+            return "Option 'bandRows' needs a session.";
+        if (opts.reduce || opts.palette || opts.quantize || opts.bit_depth)
+            return "Option 'bandRows' can't be combined with reduce, palette, quantize or bitDepth.";
+    }
+
+    return NULL;
+}
+
+// Reads the chunkSize and highWaterMark options of the streams. Leaves the
+// defaults in place when they aren't given.
+const char *
+parse_stream_options(Handle<Value> val, size_t &chunk_size, size_t &high_water)
+{
+    HandleScope scope;
+
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> cs = obj->Get(String::NewSymbol("chunkSize"));
+    if (!cs->IsUndefined()) {
+        if (!cs->IsInt32() || cs->Int32Value() < 1)
+            return "Option 'chunkSize' must be a positive integer.";
+        chunk_size = cs->Int32Value();
+    }
+    Local<Value> hw = obj->Get(String::NewSymbol("highWaterMark"));
+    if (!hw->IsUndefined()) {
+        if (!hw->IsInt32() || hw->Int32Value() < 1)
+            return "Option 'highWaterMark' must be a positive integer.";
+        high_water = hw->Int32Value();
+    }
+    return NULL;
+}
+
+// Reads a region {x, y, w, h} that has to lie within width x height.
+const char *
+parse_rect(Handle<Value> val, int width, int height, Rect &rect)
+{
+    HandleScope scope;
+
+    if (!val->IsObject())
+        return "Region must be an object {x, y, w, h}.";
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> x = obj->Get(String::NewSymbol("x"));
+    Local<Value> y = obj->Get(String::NewSymbol("y"));
+    Local<Value> w = obj->Get(String::NewSymbol("w"));
+    Local<Value> h = obj->Get(String::NewSymbol("h"));
+    if (!x->IsInt32() || !y->IsInt32() || !w->IsInt32() || !h->IsInt32())
+        return "Region must have integer x, y, w and h.";
+
+    rect = Rect(x->Int32Value(), y->Int32Value(), w->Int32Value(), h->Int32Value());
+    if (rect.x < 0 || rect.y < 0 || rect.w < 0 || rect.h < 0)
+        return "Region coordinates and dimensions can't be negative.";
+    // Written so that x + w can't overflow.
+    if (rect.x > width || rect.y > height || rect.w > width - rect.x || rect.h > height - rect.y)
+        return "Region exceeds the buffer's dimensions.";
+    return NULL;
+}
+
+// Keeps the objects the options point to alive while an encode is in the
+// thread pool.
+void
+ref_encode_options(const encode_options &opts)
+{
+    if (opts.session)
+        opts.session->Ref();
+    if (opts.cache)
+        opts.cache->Ref();
+}
+
+void
+unref_encode_options(const encode_options &opts)
+{
+    if (opts.session)
+        opts.session->Unref();
+    if (opts.cache)
+        opts.cache->Unref();
+}
+
+Handle<Value>
+encode_info_object(const encode_info &info)
+{
+    HandleScope scope;
+
+    if (!info.color_type)
+        return Undefined();
+
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("colorType"), String::New(info.color_type));
+    obj->Set(String::NewSymbol("bitDepth"), Integer::New(info.bit_depth));
+    obj->Set(String::NewSymbol("colors"), Integer::New(info.colors));
+    obj->Set(String::NewSymbol("reduced"), Boolean::New(info.reduced));
+    obj->Set(String::NewSymbol("quantized"), Boolean::New(info.quantized));
+    if (info.quantized)
+        obj->Set(String::NewSymbol("error"), Number::New(info.error));
+    obj->Set(String::NewSymbol("cached"), Boolean::New(info.cached));
+    if (info.bands) {
+        obj->Set(String::NewSymbol("bands"), Integer::New(info.bands));
+        obj->Set(String::NewSymbol("bandsReused"), Integer::New(info.bands_reused));
+    }
+
+    return scope.Close(obj);
+}
+
@@ -6,6 +6,8 @@
 
 v8::Handle<v8::Value> ErrorException(const char *msg);
 v8::Handle<v8::Value> VException(const char *msg);
+void call_handler(v8::Handle<v8::Object> obj, const char *name, int argc,
+    v8::Handle<v8::Value> *argv);
 
 struct Point {
     int x, y;
@@ -22,7 +24,65 @@ struct Rect {
 
 bool str_eq(const char *s1, const char *s2);
 
-typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA, BUF_GRAY } buffer_type;
+typedef enum { BUF_RGB, BUF_BGR, BUF_RGBA, BUF_BGRA, BUF_GRAY, BUF_GRAYA } buffer_type;
+
+int bytes_per_pixel(buffer_type buf_type, int bits);
+int row_length(int w, int bpp);
+bool rows_fit(size_t len, int h, int stride, int row_len);
+bool parse_buffer_type(const char *name, buffer_type &buf_type);
+const char *color_type_name(int color_type);
+
+class EncoderSession;
+class PngCache;
+
+// Options that can be given to encode() and encodeSync().
+struct encode_options {
+    bool reduce;
+    bool palette;
+    int bit_depth;
+    bool little_endian;
+    EncoderSession *session;
+    PngCache *cache;
+    int band_rows;      // 0 unless the session should encode in bands
+    int level;          // zlib compression level, -1 for zlib's default
+
+    // Lossy palette reduction, see Quantizer.
+    bool quantize;
+    int quant_colors;
+    int quant_quality;
+    bool quant_dither;
+    int quant_iterations;
+    int quant_time;
+
+    encode_options() : reduce(false), palette(false), bit_depth(0), little_endian(false),
+        session(NULL), cache(NULL), band_rows(0), level(-1),
+        quantize(false), quant_colors(256), quant_quality(0), quant_dither(false),
+        quant_iterations(4), quant_time(0) {}
+};
+
+// What PngEncoder actually wrote, returned by encodeInfo().
+struct encode_info {
+    const char *color_type;
+    int bit_depth;
+    int colors;
+    bool reduced;
+    bool quantized;
+    double error;
+    bool cached;
+    int bands;
+    int bands_reused;
+
+    encode_info() : color_type(NULL), bit_depth(0), colors(0), reduced(false),
+        quantized(false), error(0), cached(false), bands(0), bands_reused(0) {}
+};
+
+const char *parse_encode_options(v8::Handle<v8::Value> val, encode_options &opts);
+const char *parse_stream_options(v8::Handle<v8::Value> val, size_t &chunk_size,
+    size_t &high_water);
+const char *parse_rect(v8::Handle<v8::Value> val, int width, int height, Rect &rect);
+void ref_encode_options(const encode_options &opts);
+void unref_encode_options(const encode_options &opts);
+v8::Handle<v8::Value> encode_info_object(const encode_info &info);
 
 struct encode_request {
     v8::Persistent<v8::Function> callback;
@@ -31,6 +91,8 @@ struct encode_request {
     int png_len;
     char *error;
     char *buf_data;
+    encode_options opts;
+    encode_info info;
 };
 
 #endif
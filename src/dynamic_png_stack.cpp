@@ -1,4 +1,5 @@
 #include "png_encoder.h"
+#include "skyline_packer.h"
 #include "dynamic_png_stack.h"
 #include "buffer_compat.h"
 
@@ -30,21 +31,61 @@ DynamicPngStack::optimal_dimension()
 }
 
 void
-DynamicPngStack::construct_png_data(unsigned char *data, Point &top)
+DynamicPngStack::pack_atlas()
 {
+    std::vector<Rect> rects;
     for (vPngi it = png_stack.begin(); it != png_stack.end(); ++it) {
         Png *png = *it;
-        int start = (png->y - top.y)*width*4 + (png->x - top.x)*4;
-        unsigned char *pngdatap = png->data;
-        for (int i = 0; i < png->h; i++) {
-            unsigned char *datap = &data[start + i*width*4];
-            for (int j = 0; j < png->w; j++) {
-                *datap++ = *pngdatap++;
-                *datap++ = *pngdatap++;
-                *datap++ = *pngdatap++;
-                *datap++ = (buf_type == BUF_RGB || buf_type == BUF_BGR) ? 0x00 : *pngdatap++;
-            }
-        }
+        rects.push_back(Rect(png->x, png->y, png->w, png->h));
+    }
+    atlas.fragments = png_stack;
+    SkylinePacker::pack(rects, atlas.pos, atlas.width, atlas.height);
+}
+
+void
+DynamicPngStack::copy_fragment(unsigned char *data, int data_width, Png *png, int dx, int dy,
+    CoverageMask &coverage)
+{
+    int start = dy*data_width*bpp + dx*bpp;
+    unsigned char *pngdatap = png->data;
+    for (int i = 0; i < png->h; i++) {
+        memcpy(&data[start + i*data_width*bpp], pngdatap, png->w*bpp);
+        pngdatap += png->w*bpp;
+    }
+    if (bpp == 3)
+        coverage.add(dx, dy, png->w, png->h);
+}
+
+void
+DynamicPngStack::construct_png_data(unsigned char *data, Point &top, CoverageMask &coverage)
+{
+    for (vPngi it = png_stack.begin(); it != png_stack.end(); ++it) {
+        Png *png = *it;
+        copy_fragment(data, width, png, png->x - top.x, png->y - top.y, coverage);
+    }
+}
+
+void
+DynamicPngStack::construct_atlas_data(unsigned char *data, const Atlas &layout,
+    CoverageMask &coverage)
+{
+    for (size_t i = 0; i < layout.fragments.size(); i++) {
+        copy_fragment(data, layout.width, layout.fragments[i], layout.pos[i].x, layout.pos[i].y,
+            coverage);
+    }
+}
+
+// RGB canvases are encoded without alpha, the gaps between the fragments are
+// made transparent with a color key instead.
+void
+DynamicPngStack::prepare_encode(PngEncoder &encoder, unsigned char *data, int w, int h,
+    const CoverageMask &coverage)
+{
+    if (bpp == 3 && !coverage.is_full()) {
+        unsigned char key[3];
+        memcpy(key, INITIAL_COLOR_KEY, sizeof(key));
+        pick_color_key(data, w, h, coverage, key);
+        encoder.set_transparent_color(key);
     }
 }
 
@@ -59,24 +100,33 @@ DynamicPngStack::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encode", PngEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", PngEncodeSync);
     NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeAtlas", PngEncodeAtlasAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeAtlasSync", PngEncodeAtlasSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "placements", Placements);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeInfo", EncodeInfo);
     target->Set(String::NewSymbol("DynamicPngStack"), t->GetFunction());
 }
 
-DynamicPngStack::DynamicPngStack(buffer_type bbuf_type) :
-    buf_type(bbuf_type) {}
+DynamicPngStack::DynamicPngStack(buffer_type bbuf_type, int bbits) :
+    bits(bbits), buf_type(bbuf_type)
+{
+    bpp = bytes_per_pixel(buf_type, bits);
+}
 
 DynamicPngStack::~DynamicPngStack()
 {
     for (vPngi it = png_stack.begin(); it != png_stack.end(); ++it)
         delete *it;
+    BufferPool::report_external();
 }
 
 Handle<Value>
-DynamicPngStack::Push(unsigned char *buf_data, size_t buf_len, int x, int y, int w, int h)
+DynamicPngStack::Push(unsigned char *buf_data, int stride, int x, int y, int w, int h)
 {
     try {
-        Png *png = new Png(buf_data, buf_len, x, y, w, h);
+        Png *png = new Png(buf_data, stride, bpp, x, y, w, h);
         png_stack.push_back(png);
+        BufferPool::report_external();
         return Undefined();
     }
     catch (const char *e) {
@@ -85,7 +135,7 @@ DynamicPngStack::Push(unsigned char *buf_data, size_t buf_len, int x, int y, int
 }
 
 Handle<Value>
-DynamicPngStack::PngEncodeSync()
+DynamicPngStack::PngEncodeSync(const encode_options &opts)
 {
     HandleScope scope;
 
@@ -98,24 +148,33 @@ DynamicPngStack::PngEncodeSync()
     width = bot.x - top.x;
     height = bot.y - top.y;
 
-    unsigned char *data = (unsigned char*)malloc(sizeof(*data) * width * height * 4);
-    if (!data) return VException("malloc failed in DynamicPngStack::PngEncode");
-    memset(data, 0xFF, width*height*4);
-
-    construct_png_data(data, top);
+    unsigned char *data;
+    try {
+        data = (unsigned char *)BufferPool::allocate((size_t)width * height * bpp);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+    clear_canvas(data, (long)width*height, bpp);
 
-    buffer_type pbt = (buf_type == BUF_BGR || buf_type == BUF_BGRA) ? BUF_BGRA : BUF_RGBA;
+    CoverageMask coverage(bpp == 3 ? width : 0, height);
+    construct_png_data(data, top, coverage);
 
     try {
-        PngEncoder encoder(data, width, height, pbt, 8);
+        PngEncoder encoder(data, width, height, buf_type, bits);
+        encoder.set_options(opts);
+        prepare_encode(encoder, data, width, height, coverage);
         encoder.encode();
-        free(data);
+        info = encoder.get_info();
+        BufferPool::release(data);
         int png_len = encoder.get_png_len();
         Buffer *retbuf = Buffer::New(png_len);
         memcpy(BufferData(retbuf), encoder.get_png(), png_len);
+        BufferPool::report_external();
         return scope.Close(retbuf->handle_);
     }
     catch (const char *err) {
+        BufferPool::release(data);
         return VException(err);
     }
 }
@@ -134,21 +193,90 @@ DynamicPngStack::Dimensions()
     return scope.Close(dim);
 }
 
+Handle<Value>
+DynamicPngStack::PngEncodeAtlasSync(const encode_options &opts)
+{
+    HandleScope scope;
+
+    if (png_stack.empty())
+        return VException("DynamicPngStack is empty, nothing to pack.");
+
+    pack_atlas();
+
+    unsigned char *data;
+    try {
+        data = (unsigned char *)BufferPool::allocate((size_t)atlas.width * atlas.height * bpp);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+    clear_canvas(data, (long)atlas.width*atlas.height, bpp);
+
+    CoverageMask coverage(bpp == 3 ? atlas.width : 0, atlas.height);
+    construct_atlas_data(data, atlas, coverage);
+
+    try {
+        PngEncoder encoder(data, atlas.width, atlas.height, buf_type, bits);
+        encoder.set_options(opts);
+        prepare_encode(encoder, data, atlas.width, atlas.height, coverage);
+        encoder.encode();
+        info = encoder.get_info();
+        BufferPool::release(data);
+        int png_len = encoder.get_png_len();
+        Buffer *retbuf = Buffer::New(png_len);
+        memcpy(BufferData(retbuf), encoder.get_png(), png_len);
+        BufferPool::report_external();
+        return scope.Close(retbuf->handle_);
+    }
+    catch (const char *err) {
+        BufferPool::release(data);
+        return VException(err);
+    }
+}
+
+Handle<Value>
+DynamicPngStack::Placements()
+{
+    return placements_array(atlas);
+}
+
+Handle<Value>
+DynamicPngStack::placements_array(const Atlas &layout)
+{
+    HandleScope scope;
+
+    Local<Array> placements = Array::New(layout.pos.size());
+    for (size_t i = 0; i < layout.pos.size(); i++) {
+        Png *png = layout.fragments[i];
+        Local<Object> placement = Object::New();
+        placement->Set(String::NewSymbol("x"), Integer::New(png->x));
+        placement->Set(String::NewSymbol("y"), Integer::New(png->y));
+        placement->Set(String::NewSymbol("width"), Integer::New(png->w));
+        placement->Set(String::NewSymbol("height"), Integer::New(png->h));
+        placement->Set(String::NewSymbol("atlasX"), Integer::New(layout.pos[i].x));
+        placement->Set(String::NewSymbol("atlasY"), Integer::New(layout.pos[i].y));
+        placements->Set(i, placement);
+    }
+
+    return scope.Close(placements);
+}
+
 Handle<Value>
 DynamicPngStack::New(const Arguments &args)
 {
     HandleScope scope;
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 1) {
+    if (args.Length() >= 1) {
         if (!args[0]->IsString())
-            return VException("First argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("First argument must be 'rgb', 'bgr', 'rgba', 'bgra' or 'graya'.");
 
         String::AsciiValue bts(args[0]->ToString());
         if (!(str_eq(*bts, "rgb") || str_eq(*bts, "bgr") ||
-            str_eq(*bts, "rgba") || str_eq(*bts, "bgra")))
+            str_eq(*bts, "rgba") || str_eq(*bts, "bgra") ||
+            str_eq(*bts, "graya")))
         {
-            return VException("First argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("First argument must be 'rgb', 'bgr', 'rgba', 'bgra' or 'graya'.");
         }
         
         if (str_eq(*bts, "rgb"))
@@ -159,11 +287,28 @@ DynamicPngStack::New(const Arguments &args)
             buf_type = BUF_RGBA;
         else if (str_eq(*bts, "bgra"))
             buf_type = BUF_BGRA;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
+        else
+            return VException("First argument wasn't 'rgb', 'bgr', 'rgba', 'bgra' or 'graya'.");
+    }
+
+    int bits = 8;
+    if (args.Length() >= 2) {
+        if (buf_type != BUF_GRAYA)
+            return VException("Pixel bit width option only valid for \"graya\" buffer type");
+        if (!args[1]->IsInt32())
+            return VException("Second argument must be 8 or 16");
+
+        if (args[1]->Int32Value() == 8)
+            bits = 8;
+        else if (args[1]->Int32Value() == 16)
+            bits = 16;
         else
-            return VException("First argument wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Second argument wasn't 8 or 16");
     }
 
-    DynamicPngStack *png_stack = new DynamicPngStack(buf_type);
+    DynamicPngStack *png_stack = new DynamicPngStack(buf_type, bits);
     png_stack->Wrap(args.This());
     return args.This();
 }
@@ -200,11 +345,25 @@ DynamicPngStack::Push(const Arguments &args)
 
     DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
 
+    int row_len = row_length(w, png_stack->bpp);
+    if (row_len < 0)
+        return VException("Width too large.");
+    int stride = row_len;
+    if (args.Length() >= 6 && !args[5]->IsUndefined()) {
+        if (!args[5]->IsInt32())
+            return VException("Sixth argument must be integer stride.");
+        if (args[5]->Int32Value() < stride)
+            return VException("Stride smaller than width times bytes per pixel.");
+        stride = args[5]->Int32Value();
+    }
+
     Local<Object> buf_obj = args[0]->ToObject();
+    if (!rows_fit(BufferLength(buf_obj), h, stride, row_len))
+        return VException("Buffer too small for given width, height and stride.");
+
     char *buf_data = BufferData(buf_obj);
-    size_t buf_len = BufferLength(buf_obj);
 
-    return scope.Close(png_stack->Push((unsigned char*)buf_data, buf_len, x, y, w, h));
+    return scope.Close(png_stack->Push((unsigned char*)buf_data, stride, x, y, w, h));
 }
 
 Handle<Value>
@@ -216,13 +375,52 @@ DynamicPngStack::Dimensions(const Arguments &args)
     return scope.Close(png_stack->Dimensions());
 }
 
+Handle<Value>
+DynamicPngStack::Placements(const Arguments &args)
+{
+    HandleScope scope;
+
+    DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    return scope.Close(png_stack->Placements());
+}
+
+Handle<Value>
+DynamicPngStack::PngEncodeAtlasSync(const Arguments &args)
+{
+    HandleScope scope;
+
+    encode_options opts;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
+    DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    return scope.Close(png_stack->PngEncodeAtlasSync(opts));
+}
+
+Handle<Value>
+DynamicPngStack::EncodeInfo(const Arguments &args)
+{
+    HandleScope scope;
+
+    DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+    return scope.Close(encode_info_object(png_stack->info));
+}
+
 Handle<Value>
 DynamicPngStack::PngEncodeSync(const Arguments &args)
 {
     HandleScope scope;
 
+    encode_options opts;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
     DynamicPngStack *png_stack = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
-    return scope.Close(png_stack->PngEncodeSync());
+    return scope.Close(png_stack->PngEncodeSync(opts));
 }
 
 void
@@ -240,33 +438,31 @@ DynamicPngStack::UV_PngEncode(uv_work_t *req)
     png->width = bot.x - top.x;
     png->height = bot.y - top.y;
 
-    unsigned char *data = (unsigned char*)malloc(sizeof(*data) * png->width * png->height * 4);
-    if (!data) {
-        enc_req->error = strdup("malloc failed in DynamicPngStack::UV_PngEncode.");
+    unsigned char *data;
+    try {
+        data = (unsigned char *)BufferPool::allocate((size_t)png->width * png->height * png->bpp);
+    }
+    catch (const char *err) {
+        enc_req->error = strdup(err);
         return;
     }
-    memset(data, 0xFF, png->width*png->height*4);
+    clear_canvas(data, (long)png->width*png->height, png->bpp);
 
-    png->construct_png_data(data, top);
-
-    buffer_type pbt = (png->buf_type == BUF_BGR || png->buf_type == BUF_BGRA) ?
-        BUF_BGRA : BUF_RGBA;
+    CoverageMask coverage(png->bpp == 3 ? png->width : 0, png->height);
+    png->construct_png_data(data, top, coverage);
 
     try {
-        PngEncoder encoder(data, png->width, png->height, pbt, 8);
+        PngEncoder encoder(data, png->width, png->height, png->buf_type, png->bits);
+        encoder.set_options(enc_req->opts);
+        png->prepare_encode(encoder, data, png->width, png->height, coverage);
         encoder.encode();
-        free(data);
+        enc_req->info = encoder.get_info();
+        BufferPool::release(data);
         enc_req->png_len = encoder.get_png_len();
-        enc_req->png = (char *)malloc(sizeof(*enc_req->png)*enc_req->png_len);
-        if (!enc_req->png) {
-            enc_req->error = strdup("malloc in DynamicPngStack::UV_PngEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->png, encoder.get_png(), enc_req->png_len);
-        }
+        enc_req->png = encoder.release_png();
     }
     catch (const char *err) {
+        BufferPool::release(data);
         enc_req->error = strdup(err);
     }
 }
@@ -289,6 +485,7 @@ DynamicPngStack::UV_PngEncodeAfter(uv_work_t *req)
         argv[2] = ErrorException(enc_req->error);
     }
     else {
+        png->info = enc_req->info;
         Buffer *buf = Buffer::New(enc_req->png_len);
         memcpy(BufferData(buf), enc_req->png, enc_req->png_len);
         argv[0] = buf->handle_;
@@ -304,11 +501,13 @@ DynamicPngStack::UV_PngEncodeAfter(uv_work_t *req)
         FatalException(try_catch);
 
     enc_req->callback.Dispose();
-    free(enc_req->png);
+    unref_encode_options(enc_req->opts);
+    BufferPool::release(enc_req->png);
     free(enc_req->error);
 
     png->Unref();
     free(enc_req);
+    BufferPool::report_external();
 }
 
 Handle<Value>
@@ -316,13 +515,19 @@ DynamicPngStack::PngEncodeAsync(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1)
-        return VException("One argument required - callback function.");
+    if (args.Length() < 1 || args.Length() > 2)
+        return VException("One or two arguments required - [encode options and] callback function.");
 
-    if (!args[0]->IsFunction())
-        return VException("First argument must be a function.");
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
+
+    encode_options opts;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
     DynamicPngStack *png = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
 
     encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
@@ -334,6 +539,9 @@ DynamicPngStack::PngEncodeAsync(const Arguments &args)
     enc_req->png = NULL;
     enc_req->png_len = 0;
     enc_req->error = NULL;
+    enc_req->opts = opts;
+    enc_req->info = encode_info();
+    ref_encode_options(opts);
 
 
     uv_work_t* req = new uv_work_t;
@@ -345,3 +553,130 @@ DynamicPngStack::PngEncodeAsync(const Arguments &args)
     return Undefined();
 }
 
+// Works from the layout packed when the encode was queued, not from the
+// stack, which push() can change in the meantime.
+void
+DynamicPngStack::UV_PngEncodeAtlas(uv_work_t *req)
+{
+    atlas_request *atlas_req = (atlas_request *)req->data;
+    DynamicPngStack *png = atlas_req->png_obj;
+    const Atlas &layout = atlas_req->atlas;
+
+    unsigned char *data;
+    try {
+        data = (unsigned char *)BufferPool::allocate((size_t)layout.width * layout.height * png->bpp);
+    }
+    catch (const char *err) {
+        atlas_req->error = strdup(err);
+        return;
+    }
+    clear_canvas(data, (long)layout.width*layout.height, png->bpp);
+
+    CoverageMask coverage(png->bpp == 3 ? layout.width : 0, layout.height);
+    png->construct_atlas_data(data, layout, coverage);
+
+    try {
+        PngEncoder encoder(data, layout.width, layout.height, png->buf_type, png->bits);
+        encoder.set_options(atlas_req->opts);
+        png->prepare_encode(encoder, data, layout.width, layout.height, coverage);
+        encoder.encode();
+        atlas_req->info = encoder.get_info();
+        BufferPool::release(data);
+        atlas_req->png_len = encoder.get_png_len();
+        atlas_req->png = encoder.release_png();
+    }
+    catch (const char *err) {
+        BufferPool::release(data);
+        atlas_req->error = strdup(err);
+    }
+}
+
+void 
+DynamicPngStack::UV_PngEncodeAtlasAfter(uv_work_t *req)
+{
+    HandleScope scope;
+
+    atlas_request *atlas_req = (atlas_request *)req->data;
+    delete req;
+
+    DynamicPngStack *png = atlas_req->png_obj;
+
+    Handle<Value> argv[3];
+
+    if (atlas_req->error) {
+        argv[0] = Undefined();
+        argv[1] = Undefined();
+        argv[2] = ErrorException(atlas_req->error);
+    }
+    else {
+        png->info = atlas_req->info;
+        Buffer *buf = Buffer::New(atlas_req->png_len);
+        memcpy(BufferData(buf), atlas_req->png, atlas_req->png_len);
+        argv[0] = buf->handle_;
+        argv[1] = placements_array(atlas_req->atlas);
+        argv[2] = Undefined();
+    }
+
+    TryCatch try_catch; // don't quite see the necessity of this
+
+    atlas_req->callback->Call(Context::GetCurrent()->Global(), 3, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    atlas_req->callback.Dispose();
+    unref_encode_options(atlas_req->opts);
+    BufferPool::release(atlas_req->png);
+    free(atlas_req->error);
+
+    png->Unref();
+    delete atlas_req;
+    BufferPool::report_external();
+}
+
+Handle<Value>
+DynamicPngStack::PngEncodeAtlasAsync(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || args.Length() > 2)
+        return VException("One or two arguments required - [encode options and] callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
+
+    encode_options opts;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+    DynamicPngStack *png = ObjectWrap::Unwrap<DynamicPngStack>(args.This());
+
+    if (png->png_stack.empty())
+        return VException("DynamicPngStack is empty, nothing to pack.");
+
+    // Packed here, on the loop thread, the worker gets a copy of the layout.
+    png->pack_atlas();
+
+    atlas_request *atlas_req = new atlas_request;
+    atlas_req->callback = Persistent<Function>::New(callback);
+    atlas_req->png_obj = png;
+    atlas_req->atlas = png->atlas;
+    atlas_req->png = NULL;
+    atlas_req->png_len = 0;
+    atlas_req->error = NULL;
+    atlas_req->opts = opts;
+    atlas_req->info = encode_info();
+    ref_encode_options(opts);
+
+    uv_work_t* req = new uv_work_t;
+    req->data = atlas_req;
+    uv_queue_work(uv_default_loop(), req, UV_PngEncodeAtlas, (uv_after_work_cb)UV_PngEncodeAtlasAfter);
+
+    png->Ref();
+
+    return Undefined();
+}
+
@@ -10,22 +10,27 @@
 #include <cstdlib>
 
 #include "common.h"
+#include "png_encoder.h"
+#include "color_key.h"
+#include "buffer_pool.h"
 
 class DynamicPngStack : public node::ObjectWrap {
     struct Png {
-        int len, x, y, w, h;
+        size_t len;
+        int x, y, w, h;
         unsigned char *data;
 
-        Png(unsigned char *ddata, int llen, int xx, int yy, int ww, int hh) :
-            len(llen), x(xx), y(yy), w(ww), h(hh)
+        // Rows of the source are stride bytes apart, they're stored packed.
+        Png(unsigned char *ddata, int stride, int bpp, int xx, int yy, int ww, int hh) :
+            len((size_t)ww*hh*bpp), x(xx), y(yy), w(ww), h(hh)
         {
-            data = (unsigned char *)malloc(sizeof(*data)*len);
-            if (!data) throw "malloc failed in DynamicPngStack::Png::Png";
-            memcpy(data, ddata, len);
+            data = (unsigned char *)BufferPool::allocate(len);
+            for (int i = 0; i < h; i++)
+                memcpy(data + (size_t)i*w*bpp, ddata + (long)i*stride, (size_t)w*bpp);
         }
 
         ~Png() {
-            free(data);
+            BufferPool::release(data);
         }
     };
 
@@ -33,29 +38,68 @@ class DynamicPngStack : public node::ObjectWrap {
     typedef vPng::iterator vPngi;
     vPng png_stack;
     Point offset;
-    int width, height;
+    int width, height, bits, bpp;
     buffer_type buf_type;
 
+    // Where pack_atlas() put the fragments. Fragments are never removed, so
+    // an async encode can work from a copy while more get pushed.
+    struct Atlas {
+        vPng fragments;
+        std::vector<Point> pos;
+        int width, height;
+
+        Atlas() : width(0), height(0) {}
+    };
+
+    struct atlas_request {
+        v8::Persistent<v8::Function> callback;
+        DynamicPngStack *png_obj;
+        Atlas atlas;
+        char *png;
+        int png_len;
+        char *error;
+        encode_options opts;
+        encode_info info;
+    };
+
+    Atlas atlas;
+    encode_info info;
+
     std::pair<Point, Point> optimal_dimension();
+    void pack_atlas();
 
     static void UV_PngEncode(uv_work_t *req);
     static void UV_PngEncodeAfter(uv_work_t *req);
-    void construct_png_data(unsigned char *data, Point &top);
+    static void UV_PngEncodeAtlas(uv_work_t *req);
+    static void UV_PngEncodeAtlasAfter(uv_work_t *req);
+    void copy_fragment(unsigned char *data, int data_width, Png *png, int dx, int dy,
+        CoverageMask &coverage);
+    void construct_png_data(unsigned char *data, Point &top, CoverageMask &coverage);
+    void construct_atlas_data(unsigned char *data, const Atlas &layout, CoverageMask &coverage);
+    static v8::Handle<v8::Value> placements_array(const Atlas &layout);
+    void prepare_encode(PngEncoder &encoder, unsigned char *data, int w, int h,
+        const CoverageMask &coverage);
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    DynamicPngStack(buffer_type bbuf_type);
+    DynamicPngStack(buffer_type bbuf_type, int bbits);
     ~DynamicPngStack();
 
-    v8::Handle<v8::Value> Push(unsigned char *buf_data, size_t buf_len, int x, int y, int w, int h);
+    v8::Handle<v8::Value> Push(unsigned char *buf_data, int stride, int x, int y, int w, int h);
     v8::Handle<v8::Value> Dimensions();
-    v8::Handle<v8::Value> PngEncodeSync();
+    v8::Handle<v8::Value> Placements();
+    v8::Handle<v8::Value> PngEncodeSync(const encode_options &opts);
+    v8::Handle<v8::Value> PngEncodeAtlasSync(const encode_options &opts);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
     static v8::Handle<v8::Value> Dimensions(const v8::Arguments &args);
     static v8::Handle<v8::Value> PngEncodeSync(const v8::Arguments &args);
     static v8::Handle<v8::Value> PngEncodeAsync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Placements(const v8::Arguments &args);
+    static v8::Handle<v8::Value> PngEncodeAtlasSync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> PngEncodeAtlasAsync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeInfo(const v8::Arguments &args);
 };
 
 #endif
@@ -0,0 +1,117 @@
+#include "encoder_session.h"
+
+using namespace v8;
+using namespace node;
+
+Persistent<FunctionTemplate> EncoderSession::constructor_template;
+
+void
+EncoderSession::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "reset", Reset);
+    NODE_SET_PROTOTYPE_METHOD(t, "colors", Colors);
+    target->Set(String::NewSymbol("EncoderSession"), t->GetFunction());
+}
+
+bool
+EncoderSession::HasInstance(Handle<Value> val)
+{
+    if (!val->IsObject())
+        return false;
+    return constructor_template->HasInstance(val->ToObject());
+}
+
+EncoderSession::EncoderSession()
+{
+    uv_mutex_init(&lock);
+}
+
+EncoderSession::~EncoderSession()
+{
+    uv_mutex_destroy(&lock);
+}
+
+// Maps the frame onto the session's palette, adding the colors it hasn't
+// seen yet. Colors keep their index from frame to frame. If the frame would
+// take the palette over 256 colors the session is left untouched and false
+// is returned. Called from the thread pool, hence the lock.
+bool
+EncoderSession::extend_palette(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, const unsigned int *color_key, Palette &out)
+{
+    uv_mutex_lock(&lock);
+    out = palette;
+    bool fits = out.build(data, width, height, stride, buf_type, color_key);
+    if (fits)
+        palette = out;
+    uv_mutex_unlock(&lock);
+    return fits;
+}
+
+// Encodes the frame with the session's BandedEncoder, which reuses the
+// compressed bands that match the previous frame. Returns the number of
+// bands reused.
+int
+EncoderSession::encode_banded(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, int bits, bool little_endian, int band_rows, int level,
+    const unsigned short *trns, std::vector<unsigned char> &png)
+{
+    uv_mutex_lock(&lock);
+    try {
+        int reused = banded.encode(data, width, height, stride, buf_type, bits,
+            little_endian, band_rows, level, trns, png);
+        uv_mutex_unlock(&lock);
+        return reused;
+    }
+    catch (const char *err) {
+        uv_mutex_unlock(&lock);
+        throw;
+    }
+}
+
+void
+EncoderSession::reset()
+{
+    uv_mutex_lock(&lock);
+    palette = Palette();
+    banded.reset();
+    uv_mutex_unlock(&lock);
+}
+
+Handle<Value>
+EncoderSession::New(const Arguments &args)
+{
+    HandleScope scope;
+
+    EncoderSession *session = new EncoderSession();
+    session->Wrap(args.This());
+    return args.This();
+}
+
+Handle<Value>
+EncoderSession::Reset(const Arguments &args)
+{
+    HandleScope scope;
+
+    EncoderSession *session = ObjectWrap::Unwrap<EncoderSession>(args.This());
+    session->reset();
+    return Undefined();
+}
+
+Handle<Value>
+EncoderSession::Colors(const Arguments &args)
+{
+    HandleScope scope;
+
+    EncoderSession *session = ObjectWrap::Unwrap<EncoderSession>(args.This());
+    uv_mutex_lock(&session->lock);
+    int colors = session->palette.size();
+    uv_mutex_unlock(&session->lock);
+    return scope.Close(Integer::New(colors));
+}
+
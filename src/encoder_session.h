@@ -0,0 +1,43 @@
+#ifndef ENCODER_SESSION_H
+#define ENCODER_SESSION_H
+
+#include <node.h>
+
+#include <vector>
+
+#include "banded_encoder.h"
+#include "common.h"
+#include "palette.h"
+
+// State kept between encodes of successive frames. Passed to encode() and
+// encodeSync() with the session option.
+class EncoderSession : public node::ObjectWrap {
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
+    uv_mutex_t lock;
+    Palette palette;
+    BandedEncoder banded;
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    static bool HasInstance(v8::Handle<v8::Value> val);
+    EncoderSession();
+    ~EncoderSession();
+
+    using node::ObjectWrap::Ref;
+    using node::ObjectWrap::Unref;
+
+    bool extend_palette(const unsigned char *data, int width, int height, int stride,
+        buffer_type buf_type, const unsigned int *color_key, Palette &out);
+    int encode_banded(const unsigned char *data, int width, int height, int stride,
+        buffer_type buf_type, int bits, bool little_endian, int band_rows, int level,
+        const unsigned short *trns, std::vector<unsigned char> &png);
+    void reset();
+
+    static v8::Handle<v8::Value> New(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Reset(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Colors(const v8::Arguments &args);
+};
+
+#endif
+
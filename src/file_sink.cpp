@@ -0,0 +1,221 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <uv.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "file_sink.h"
+
+#ifdef _WIN32
+static int sys_open(const char *path) {
+    return _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+static int sys_write(int fd, const char *data, size_t len) { return _write(fd, data, len); }
+static int sys_fsync(int fd) { return _commit(fd); }
+static int sys_close(int fd) { return _close(fd); }
+static int sys_unlink(const char *path) { return _unlink(path); }
+static int sys_rename(const char *from, const char *to) {
+    if (MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING))
+        return 0;
+    errno = EACCES;
+    return -1;
+}
+static int sys_getpid() { return _getpid(); }
+#else
+static int sys_open(const char *path) { return open(path, O_WRONLY | O_CREAT | O_EXCL, 0644); }
+static int sys_write(int fd, const char *data, size_t len) { return write(fd, data, len); }
+static int sys_fsync(int fd) { return fsync(fd); }
+static int sys_close(int fd) { return close(fd); }
+static int sys_unlink(const char *path) { return unlink(path); }
+static int sys_rename(const char *from, const char *to) { return rename(from, to); }
+static int sys_getpid() { return getpid(); }
+#endif
+
+// Numbers the temporary files of the encodes running at the same time.
+static uv_mutex_t count_lock;
+static unsigned int temp_count;
+
+// Writes all of data, retrying short and interrupted writes.
+static bool
+write_all(int fd, const char *data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        int n = sys_write(fd, data + done, len - done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+void
+FileSink::Initialize()
+{
+    uv_mutex_init(&count_lock);
+}
+
+FileSink::FileSink(const char *ppath, size_t buf_size) :
+    path(ppath), fd(-1), created(false), synced(false), buf(buf_size), used(0), bytes(0)
+{
+    error[0] = '\0';
+}
+
+FileSink::~FileSink()
+{
+    if (fd != -1)
+        sys_close(fd);
+}
+
+void
+FileSink::fail(const char *what, const std::string &file)
+{
+    snprintf(error, sizeof(error), "%s %s failed: %s", what, file.c_str(), strerror(errno));
+    throw (const char *)error;
+}
+
+// Creates the temporary file. A name that's taken, say by a crashed
+// process that had the same pid, is skipped.
+void
+FileSink::open()
+{
+    for (;;) {
+        uv_mutex_lock(&count_lock);
+        unsigned int n = temp_count++;
+        uv_mutex_unlock(&count_lock);
+
+        char suffix[64];
+        snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", sys_getpid(), n);
+        tmp_path = path + suffix;
+        fd = sys_open(tmp_path.c_str());
+        if (fd != -1)
+            break;
+        if (errno != EEXIST)
+            fail("Opening", tmp_path);
+    }
+    created = true;
+    keep_mode();
+}
+
+// Gives the temporary file the mode and owner of the file it's going to
+// replace. The owner can only be kept where we're allowed to, otherwise
+// the new file is ours.
+void
+FileSink::keep_mode()
+{
+#ifndef _WIN32
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        return;
+    if (fchmod(fd, st.st_mode & 07777) == -1)
+        fail("Setting the mode of", tmp_path);
+    if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+        fail("Setting the owner of", tmp_path);
+#endif
+}
+
+// Makes the rename itself durable. Windows has no way to sync a directory.
+void
+FileSink::sync_dir()
+{
+#ifndef _WIN32
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." :
+        slash == 0 ? "/" : path.substr(0, slash);
+    int dir_fd = ::open(dir.c_str(), O_RDONLY);
+    if (dir_fd == -1)
+        fail("Opening", dir);
+    int ret = sys_fsync(dir_fd);
+    sys_close(dir_fd);
+    if (ret == -1)
+        fail("Syncing", dir);
+#endif
+}
+
+void
+FileSink::flush()
+{
+    if (used && !write_all(fd, &buf[0], used))
+        fail("Writing", tmp_path);
+    used = 0;
+}
+
+// PngSink, small writes are gathered in buf, bigger ones go straight out.
+void
+FileSink::write(const char *data, unsigned int len)
+{
+    if (used + len > buf.size())
+        flush();
+    if (len >= buf.size()) {
+        if (!write_all(fd, data, len))
+            fail("Writing", tmp_path);
+    }
+    else {
+        memcpy(&buf[used], data, len);
+        used += len;
+    }
+    bytes += len;
+}
+
+// Flushes the buffer and fsyncs. Returns the milliseconds fsync took.
+double
+FileSink::sync()
+{
+    flush();
+    uint64_t start = uv_hrtime();
+    if (sys_fsync(fd) == -1)
+        fail("Syncing", tmp_path);
+    synced = true;
+    return (uv_hrtime() - start)/1e6;
+}
+
+// Closes the temporary file and renames it to path, the last one renamed
+// wins if several encodes write the same path. After sync() the directory
+// is synced as well.
+void
+FileSink::close()
+{
+    flush();
+    int ret = sys_close(fd);
+    fd = -1;
+    if (ret == -1)
+        fail("Closing", tmp_path);
+    if (sys_rename(tmp_path.c_str(), path.c_str()) == -1)
+        fail("Renaming to", path);
+    created = false;
+    if (synced)
+        sync_dir();
+}
+
+// Gets rid of the partly written temporary file after an error, path itself
+// is never touched.
+void
+FileSink::remove()
+{
+    if (fd != -1) {
+        sys_close(fd);
+        fd = -1;
+    }
+    if (created)
+        sys_unlink(tmp_path.c_str());
+    created = false;
+}
+
+double
+FileSink::get_bytes() const
+{
+    return bytes;
+}
@@ -0,0 +1,43 @@
+#ifndef FILE_SINK_H
+#define FILE_SINK_H
+
+#include <string>
+#include <vector>
+
+#include "png_encoder.h"
+
+// Writes the PNG straight to a file as the encoder produces it, through a
+// buffer so the file gets large writes instead of one per libpng flush.
+// The data goes to a temporary file next to path, named path.<pid>.<n>.tmp,
+// which only replaces path once it's all written and closed, so a failed
+// encode leaves the old file alone. Errors are thrown as const char * and
+// stay valid while the FileSink lives.
+class FileSink : public PngSink {
+    std::string path, tmp_path;
+    int fd;
+    bool created;   // tmp_path is ours to remove
+    bool synced;    // the directory gets fsynced after the rename too
+    std::vector<char> buf;
+    size_t used;
+    double bytes;
+    char error[512];
+
+    void fail(const char *what, const std::string &file);
+    void flush();
+    void keep_mode();
+    void sync_dir();
+
+public:
+    static void Initialize();
+    FileSink(const char *ppath, size_t buf_size);
+    ~FileSink();
+
+    void open();
+    void write(const char *data, unsigned int len);
+    double sync();
+    void close();
+    void remove();
+    double get_bytes() const;
+};
+
+#endif
@@ -1,7 +1,11 @@
 #include <cstdlib>
+#include <cstdio>
+#include <algorithm>
 
 #include "png_encoder.h"
+#include "png_cache.h"
 #include "fixed_png_stack.h"
+#include "buffer_pool.h"
 #include "buffer_compat.h"
 
 using namespace v8;
@@ -17,50 +21,173 @@ FixedPngStack::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", PngEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", PngEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeInfo", EncodeInfo);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeTiles", EncodeTilesAsync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeTilesSync", EncodeTilesSync);
     target->Set(String::NewSymbol("FixedPngStack"), t->GetFunction());
 }
 
-FixedPngStack::FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type) :
-    width(wwidth), height(hheight), buf_type(bbuf_type)
+FixedPngStack::FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type, int bbits) :
+    width(wwidth), height(hheight), bits(bbits), buf_type(bbuf_type),
+    coverage((bbuf_type == BUF_RGB || bbuf_type == BUF_BGR) ? wwidth : 0, hheight)
 { 
-    data = (unsigned char *)malloc(sizeof(*data) * width * height * 4);
-    if (!data) throw "malloc failed in node-png (FixedPngStack ctor)";
-    memset(data, 0xFF, width*height*4);
+    bpp = bytes_per_pixel(buf_type, bits);
+    data = (unsigned char *)BufferPool::allocate((size_t)width * height * bpp);
+    clear_canvas(data, (long)width*height, bpp);
+    memcpy(color_key, INITIAL_COLOR_KEY, sizeof(color_key));
 }
 
 FixedPngStack::~FixedPngStack()
 {
-    free(data);
+    BufferPool::release(data);
+    BufferPool::report_external();
 }
 
 void
-FixedPngStack::Push(unsigned char *buf_data, int x, int y, int w, int h)
+FixedPngStack::Push(unsigned char *buf_data, int x, int y, int w, int h, int stride)
 {
-    int start = y*width*4 + x*4;
+    long start = ((long)y*width + x)*bpp;
     for (int i = 0; i < h; i++) {
-        unsigned char *datap = &data[start + i*width*4];
-        for (int j = 0; j < w; j++) {
-            *datap++ = *buf_data++;
-            *datap++ = *buf_data++;
-            *datap++ = *buf_data++;
-            *datap++ = (buf_type == BUF_RGB || buf_type == BUF_BGR) ? 0x00 : *buf_data++;
+        memcpy(&data[start + (long)i*width*bpp], buf_data, (size_t)w*bpp);
+        buf_data += stride;
+    }
+    if (bpp == 3)
+        coverage.add(x, y, w, h);
+}
+
+// RGB canvases are encoded without alpha, the pixels that nothing was pushed
+// to are made transparent with a color key instead. Makes sure color_key is
+// free on the canvas, repainting the uncovered pixels if it had to change,
+// and returns whether there are any, that is whether encodes need the key.
+// Touches data, so it runs on the loop thread.
+bool
+FixedPngStack::pick_key()
+{
+    if (bpp != 3 || coverage.is_full())
+        return false;
+    pick_color_key(data, width, height, coverage, color_key);
+    return true;
+}
+
+// Splits the canvas into tile_size tiles, runs on the loop thread so that
+// the coverage can't change under it.
+void
+FixedPngStack::layout_tiles(int tile_size, std::vector<Tile> &tiles)
+{
+    tiles.clear();
+    if (width <= 0 || height <= 0)
+        return;
+    tile_size = std::min(tile_size, std::max(width, height));
+    int tiles_x = (width - 1)/tile_size + 1;
+    int tiles_y = (height - 1)/tile_size + 1;
+    tiles.resize(tiles_x*tiles_y);
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Tile &tile = tiles[ty*tiles_x + tx];
+            int x = tx*tile_size, y = ty*tile_size;
+            tile.id = ty*tiles_x + tx;
+            tile.rect = Rect(x, y, std::min(tile_size, width - x), std::min(tile_size, height - y));
+            tile.keyed = bpp == 3 && !coverage.covers(tile.rect);
         }
     }
 }
 
+// Encodes each of the tiles from layout_tiles on its own, the keyed ones
+// with key as their transparent color. Only those carry a tRNS chunk, so a
+// fully pushed tile hashes the same whatever key the canvas has. A tile is
+// identified by the hash of its pixels and encode options; with a cache the
+// tiles it already has (and so the client has seen) aren't encoded again,
+// the cache only remembers that they were sent.
+void
+FixedPngStack::encode_tiles(const encode_options &opts, const unsigned char *key,
+    std::vector<Tile> &tiles)
+{
+    encode_options tile_opts = opts;
+    tile_opts.cache = NULL;
+
+    for (size_t i = 0; i < tiles.size(); i++) {
+        Tile &tile = tiles[i];
+        PngEncoder encoder(data + ((long)tile.rect.y*width + tile.rect.x)*bpp,
+            tile.rect.w, tile.rect.h, buf_type, bits);
+        encoder.set_stride(width*bpp);
+        encoder.set_options(tile_opts);
+        if (tile.keyed)
+            encoder.set_transparent_color(key);
+        tile.hash = encoder.cache_key();
+
+        if (opts.cache && opts.cache->touch(tile.hash))
+            continue;
+        encoder.encode();
+        tile.png.assign(encoder.get_png(), encoder.get_png() + encoder.get_png_len());
+        if (opts.cache)
+            opts.cache->put(tile.hash, encoder.get_png(), encoder.get_png_len(), encoder.get_info());
+    }
+}
+
 Handle<Value>
-FixedPngStack::PngEncodeSync()
+FixedPngStack::tiles_array(const std::vector<Tile> &tiles)
 {
     HandleScope scope;
 
-    buffer_type pbt = (buf_type == BUF_BGR || buf_type == BUF_BGRA) ? BUF_BGRA : BUF_RGBA;
+    Local<Array> result = Array::New(tiles.size());
+    for (size_t i = 0; i < tiles.size(); i++) {
+        const Tile &tile = tiles[i];
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)tile.hash);
+
+        Local<Object> obj = Object::New();
+        obj->Set(String::NewSymbol("tileId"), Integer::New(tile.id));
+        obj->Set(String::NewSymbol("x"), Integer::New(tile.rect.x));
+        obj->Set(String::NewSymbol("y"), Integer::New(tile.rect.y));
+        obj->Set(String::NewSymbol("w"), Integer::New(tile.rect.w));
+        obj->Set(String::NewSymbol("h"), Integer::New(tile.rect.h));
+        obj->Set(String::NewSymbol("hash"), String::New(hash));
+        if (tile.png.empty()) {
+            obj->Set(String::NewSymbol("cachedRef"), String::New(hash));
+        }
+        else {
+            Buffer *buf = Buffer::New(tile.png.size());
+            memcpy(BufferData(buf), &tile.png[0], tile.png.size());
+            obj->Set(String::NewSymbol("png"), buf->handle_);
+        }
+        result->Set(i, obj);
+    }
+    return scope.Close(result);
+}
+
+// Reads the tileSize option, encode options come from the same object.
+static const char *
+parse_tile_size(Handle<Value> val, int &tile_size)
+{
+    tile_size = 64;
+    if (!val->IsObject())
+        return NULL;
+
+    Local<Value> ts = val->ToObject()->Get(String::NewSymbol("tileSize"));
+    if (!ts->IsUndefined()) {
+        if (!ts->IsInt32() || ts->Int32Value() < 1)
+            return "Option 'tileSize' must be a positive integer.";
+        tile_size = ts->Int32Value();
+    }
+    return NULL;
+}
+
+Handle<Value>
+FixedPngStack::PngEncodeSync(const encode_options &opts)
+{
+    HandleScope scope;
 
     try {
-        PngEncoder encoder(data, width, height, pbt, 8);
+        PngEncoder encoder(data, width, height, buf_type, bits);
+        encoder.set_options(opts);
+        if (pick_key())
+            encoder.set_transparent_color(color_key);
         encoder.encode();
+        info = encoder.get_info();
         int png_len = encoder.get_png_len();
         Buffer *retbuf = Buffer::New(png_len);
         memcpy(BufferData(retbuf), encoder.get_png(), png_len);
+        BufferPool::report_external();
         return scope.Close(retbuf->handle_);
     }
     catch (const char *err) {
@@ -74,22 +201,23 @@ FixedPngStack::New(const Arguments &args)
     HandleScope scope;
 
     if (args.Length() < 2)
-        return VException("At least two arguments required - width and height [and input buffer type].");
+        return VException("At least two arguments required - width and height [, input buffer type and bit width].");
     if (!args[0]->IsInt32())
         return VException("First argument must be integer width.");
     if (!args[1]->IsInt32())
         return VException("Second argument must be integer height.");
 
     buffer_type buf_type = BUF_RGB;
-    if (args.Length() == 3) {
+    if (args.Length() >= 3) {
         if (!args[2]->IsString())
-            return VException("Third argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Third argument must be 'rgb', 'bgr', 'rgba', 'bgra' or 'graya'.");
 
         String::AsciiValue bts(args[2]->ToString());
         if (!(str_eq(*bts, "rgb") || str_eq(*bts, "bgr") ||
-                    str_eq(*bts, "rgba") || str_eq(*bts, "bgra")))
+                    str_eq(*bts, "rgba") || str_eq(*bts, "bgra") ||
+                    str_eq(*bts, "graya")))
         {
-            return VException("Third argument must be 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Third argument must be 'rgb', 'bgr', 'rgba', 'bgra' or 'graya'.");
         }
 
         if (str_eq(*bts, "rgb"))
@@ -100,16 +228,34 @@ FixedPngStack::New(const Arguments &args)
             buf_type = BUF_RGBA;
         else if (str_eq(*bts, "bgra"))
             buf_type = BUF_BGRA;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
         else
-            return VException("Third argument wasn't 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Third argument wasn't 'rgb', 'bgr', 'rgba', 'bgra' or 'graya'.");
+    }
+
+    int bits = 8;
+    if (args.Length() >= 4) {
+        if (buf_type != BUF_GRAYA)
+            return VException("Pixel bit width option only valid for \"graya\" buffer type");
+        if (!args[3]->IsInt32())
+            return VException("Fourth argument must be 8 or 16");
+
+        if (args[3]->Int32Value() == 8)
+            bits = 8;
+        else if (args[3]->Int32Value() == 16)
+            bits = 16;
+        else
+            return VException("Fourth argument wasn't 8 or 16");
     }
 
     int width = args[0]->Int32Value();
     int height = args[1]->Int32Value();
 
     try {
-        FixedPngStack *png_stack = new FixedPngStack(width, height, buf_type);
+        FixedPngStack *png_stack = new FixedPngStack(width, height, buf_type, bits);
         png_stack->Wrap(args.This());
+        BufferPool::report_external();
         return args.This();
     }
     catch (const char *e) {
@@ -151,14 +297,30 @@ FixedPngStack::Push(const Arguments &args)
         return VException("Coordinate x exceeds FixedPngStack's dimensions.");
     if (y >= png_stack->height) 
         return VException("Coordinate y exceeds FixedPngStack's dimensions.");
-    if (x+w > png_stack->width) 
+    if (w > png_stack->width - x) 
         return VException("Pushed PNG exceeds FixedPngStack's width.");
-    if (y+h > png_stack->height) 
+    if (h > png_stack->height - y) 
         return VException("Pushed PNG exceeds FixedPngStack's height.");
 
-    char *buf_data = BufferData(args[0]->ToObject());
+    int row_len = row_length(w, png_stack->bpp);
+    if (row_len < 0)
+        return VException("Width too large.");
+    int stride = row_len;
+    if (args.Length() >= 6 && !args[5]->IsUndefined()) {
+        if (!args[5]->IsInt32())
+            return VException("Sixth argument must be integer stride.");
+        if (args[5]->Int32Value() < stride)
+            return VException("Stride smaller than width times bytes per pixel.");
+        stride = args[5]->Int32Value();
+    }
+
+    Local<Object> buf_obj = args[0]->ToObject();
+    if (!rows_fit(BufferLength(buf_obj), h, stride, row_len))
+        return VException("Buffer too small for given width, height and stride.");
+
+    char *buf_data = BufferData(buf_obj);
 
-    png_stack->Push((unsigned char*)buf_data, x, y, w, h);
+    png_stack->Push((unsigned char*)buf_data, x, y, w, h, stride);
 
     return Undefined();
 }
@@ -168,28 +330,46 @@ FixedPngStack::PngEncodeSync(const Arguments &args)
 {
     HandleScope scope;
 
+    encode_options opts;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
+    FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    return scope.Close(png_stack->PngEncodeSync(opts));
+}
+
+Handle<Value>
+FixedPngStack::EncodeInfo(const Arguments &args)
+{
+    HandleScope scope;
+
     FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
-    return png_stack->PngEncodeSync();
+    return scope.Close(encode_info_object(png_stack->info));
 }
 
+// An encode_request with a copy of the color key picked for it.
+struct keyed_encode_request : encode_request {
+    bool keyed;
+    unsigned char color_key[3];
+};
+
 void
 FixedPngStack::UV_PngEncode(uv_work_t *req)
 {
-    encode_request *enc_req = (encode_request *)req->data;
+    keyed_encode_request *enc_req = (keyed_encode_request *)req->data;
     FixedPngStack *png = (FixedPngStack *)enc_req->png_obj;
 
     try {
-        PngEncoder encoder(png->data, png->width, png->height, png->buf_type, 8);
+        PngEncoder encoder(png->data, png->width, png->height, png->buf_type, png->bits);
+        encoder.set_options(enc_req->opts);
+        if (enc_req->keyed)
+            encoder.set_transparent_color(enc_req->color_key);
         encoder.encode();
-        enc_req->png_len =encoder.get_png_len();
-        enc_req->png = (char *)malloc(sizeof(*enc_req->png)*enc_req->png_len);
-        if (!enc_req->png) {
-            enc_req->error = strdup("malloc in FixedPngStack::UV_PngEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->png,encoder.get_png(), enc_req->png_len);
-        }
+        enc_req->info = encoder.get_info();
+        enc_req->png_len = encoder.get_png_len();
+        enc_req->png = encoder.release_png();
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -211,6 +391,7 @@ FixedPngStack::UV_PngEncodeAfter(uv_work_t *req)
         argv[1] = ErrorException(enc_req->error);
     }
     else {
+        ((FixedPngStack *)enc_req->png_obj)->info = enc_req->info;
         Buffer *buf = Buffer::New(enc_req->png_len);
         memcpy(BufferData(buf), enc_req->png, enc_req->png_len);
         argv[0] = buf->handle_;
@@ -225,11 +406,13 @@ FixedPngStack::UV_PngEncodeAfter(uv_work_t *req)
         FatalException(try_catch);
 
     enc_req->callback.Dispose();
-    free(enc_req->png);
+    unref_encode_options(enc_req->opts);
+    BufferPool::release(enc_req->png);
     free(enc_req->error);
 
     ((FixedPngStack *)enc_req->png_obj)->Unref();
     free(enc_req);
+    BufferPool::report_external();
 }
 
 Handle<Value>
@@ -237,24 +420,44 @@ FixedPngStack::PngEncodeAsync(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1)
-        return VException("One argument required - callback function.");
+    if (args.Length() < 1 || args.Length() > 2)
+        return VException("One or two arguments required - [encode options and] callback function.");
 
-    if (!args[0]->IsFunction())
-        return VException("First argument must be a function.");
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
+    encode_options opts;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
     FixedPngStack *png = ObjectWrap::Unwrap<FixedPngStack>(args.This());
 
-    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
+    // The key is picked here, the worker only reads the canvas.
+    bool keyed;
+    try {
+        keyed = png->pick_key();
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    keyed_encode_request *enc_req = (keyed_encode_request *)malloc(sizeof(*enc_req));
     if (!enc_req)
         return VException("malloc in FixedPngStack::PngEncodeAsync failed.");
 
+    enc_req->keyed = keyed;
+    memcpy(enc_req->color_key, png->color_key, sizeof(enc_req->color_key));
     enc_req->callback = Persistent<Function>::New(callback);
     enc_req->png_obj = png;
     enc_req->png = NULL;
     enc_req->png_len = 0;
     enc_req->error = NULL;
+    enc_req->opts = opts;
+    enc_req->info = encode_info();
+    ref_encode_options(opts);
 
     uv_work_t* req = new uv_work_t;
     req->data = enc_req;
@@ -265,3 +468,135 @@ FixedPngStack::PngEncodeAsync(const Arguments &args)
     return Undefined();
 }
 
+
+Handle<Value>
+FixedPngStack::EncodeTilesSync(const Arguments &args)
+{
+    HandleScope scope;
+
+    encode_options opts;
+    int tile_size = 64;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err) err = parse_tile_size(args[0], tile_size);
+        if (err) return VException(err);
+    }
+
+    FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+    try {
+        std::vector<Tile> tiles;
+        png_stack->pick_key();
+        png_stack->layout_tiles(tile_size, tiles);
+        png_stack->encode_tiles(opts, png_stack->color_key, tiles);
+        BufferPool::report_external();
+        return scope.Close(tiles_array(tiles));
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+}
+
+struct tiles_request {
+    Persistent<Function> callback;
+    FixedPngStack *png_stack;
+    encode_options opts;
+    unsigned char color_key[3];
+    std::vector<FixedPngStack::Tile> tiles;
+    char *error;
+};
+
+void
+FixedPngStack::UV_EncodeTiles(uv_work_t *req)
+{
+    tiles_request *tiles_req = (tiles_request *)req->data;
+
+    try {
+        tiles_req->png_stack->encode_tiles(tiles_req->opts, tiles_req->color_key, tiles_req->tiles);
+    }
+    catch (const char *err) {
+        tiles_req->error = strdup(err);
+    }
+}
+
+void
+FixedPngStack::UV_EncodeTilesAfter(uv_work_t *req)
+{
+    HandleScope scope;
+
+    tiles_request *tiles_req = (tiles_request *)req->data;
+    delete req;
+
+    Handle<Value> argv[2];
+
+    if (tiles_req->error) {
+        argv[0] = Undefined();
+        argv[1] = ErrorException(tiles_req->error);
+    }
+    else {
+        argv[0] = tiles_array(tiles_req->tiles);
+        argv[1] = Undefined();
+    }
+
+    TryCatch try_catch;
+
+    tiles_req->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    tiles_req->callback.Dispose();
+    unref_encode_options(tiles_req->opts);
+    free(tiles_req->error);
+
+    tiles_req->png_stack->Unref();
+    delete tiles_req;
+    BufferPool::report_external();
+}
+
+Handle<Value>
+FixedPngStack::EncodeTilesAsync(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || args.Length() > 2)
+        return VException("One or two arguments required - [encode options and] callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
+
+    encode_options opts;
+    int tile_size = 64;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (!err) err = parse_tile_size(args[0], tile_size);
+        if (err) return VException(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+    FixedPngStack *png_stack = ObjectWrap::Unwrap<FixedPngStack>(args.This());
+
+    // The key is picked and the tiles laid out here, the worker only reads
+    // the canvas.
+    try {
+        png_stack->pick_key();
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+    tiles_request *tiles_req = new tiles_request;
+    tiles_req->callback = Persistent<Function>::New(callback);
+    tiles_req->png_stack = png_stack;
+    tiles_req->opts = opts;
+    memcpy(tiles_req->color_key, png_stack->color_key, sizeof(tiles_req->color_key));
+    png_stack->layout_tiles(tile_size, tiles_req->tiles);
+    tiles_req->error = NULL;
+    ref_encode_options(opts);
+
+    uv_work_t* req = new uv_work_t;
+    req->data = tiles_req;
+    uv_queue_work(uv_default_loop(), req, UV_EncodeTiles, (uv_after_work_cb)UV_EncodeTilesAfter);
+
+    png_stack->Ref();
+
+    return Undefined();
+}
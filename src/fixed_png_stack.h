@@ -4,28 +4,61 @@
 #include <node.h>
 #include <node_buffer.h>
 
+#include <vector>
+
 #include "common.h"
+#include "png_encoder.h"
+#include "color_key.h"
 
 class FixedPngStack : public node::ObjectWrap {
-    int width, height;
+public:
+    // One tile of encodeTiles(). png is empty if the tile was in the cache.
+    // keyed tiles have pixels nothing was pushed to and get the color key.
+    struct Tile {
+        int id;
+        Rect rect;
+        bool keyed;
+        uint64_t hash;
+        std::vector<char> png;
+    };
+
+private:
+    int width, height, bits, bpp;
     unsigned char *data;
     buffer_type buf_type;
 
+    // Only used by RGB stacks, which have no alpha to mark the uncovered
+    // pixels with.
+    CoverageMask coverage;
+    unsigned char color_key[3];
+    encode_info info;
+
+    bool pick_key();
+    void layout_tiles(int tile_size, std::vector<Tile> &tiles);
+    void encode_tiles(const encode_options &opts, const unsigned char *key,
+        std::vector<Tile> &tiles);
+    static v8::Handle<v8::Value> tiles_array(const std::vector<Tile> &tiles);
+
     static void UV_PngEncode(uv_work_t *req);
     static void UV_PngEncodeAfter(uv_work_t *req);
+    static void UV_EncodeTiles(uv_work_t *req);
+    static void UV_EncodeTilesAfter(uv_work_t *req);
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type);
+    FixedPngStack(int wwidth, int hheight, buffer_type bbuf_type, int bbits);
     ~FixedPngStack();
 
-    void Push(unsigned char *buf_data, int x, int y, int w, int h);
-    v8::Handle<v8::Value> PngEncodeSync();
+    void Push(unsigned char *buf_data, int x, int y, int w, int h, int stride);
+    v8::Handle<v8::Value> PngEncodeSync(const encode_options &opts);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
     static v8::Handle<v8::Value> PngEncodeSync(const v8::Arguments &args);
     static v8::Handle<v8::Value> PngEncodeAsync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeInfo(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeTilesSync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeTilesAsync(const v8::Arguments &args);
 };
 #endif
 
@@ -0,0 +1,364 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// The build doesn't ask for AVX2, so the AVX2 compare is compiled for it on
+// its own and picked when the CPU has it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
+
+#include <algorithm>
+#include <queue>
+
+#include "frame_diff.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+// Most runs of dirty tiles merge_rects is given, see find_dirty_rects.
+static const size_t MAX_RUNS = 256;
+
+void
+FrameDiff::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    NODE_SET_METHOD(target, "diff", Diff);
+}
+
+static bool
+bytes_equal_sse2(const unsigned char *a, const unsigned char *b, int len)
+{
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF)
+            return false;
+    }
+#endif
+    return memcmp(a + i, b + i, len - i) == 0;
+}
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2"))) static bool
+bytes_equal_avx2(const unsigned char *a, const unsigned char *b, int len)
+{
+    int i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != -1)
+            return false;
+    }
+    return bytes_equal_sse2(a + i, b + i, len - i);
+}
+#endif
+
+bool
+bytes_equal(const unsigned char *a, const unsigned char *b, int len)
+{
+#ifdef HAVE_AVX2_TARGET
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2)
+        return bytes_equal_avx2(a, b, len);
+#endif
+    return bytes_equal_sse2(a, b, len);
+}
+
+static long
+area(const Rect &r)
+{
+    return (long)r.w*r.h;
+}
+
+static Rect
+bounding_rect(const Rect &a, const Rect &b)
+{
+    int x = std::min(a.x, b.x), y = std::min(a.y, b.y);
+    int x2 = std::max(a.x + a.w, b.x + b.w), y2 = std::max(a.y + a.h, b.y + b.h);
+    return Rect(x, y, x2 - x, y2 - y);
+}
+
+// Pixels of the bounding rectangle of a and b that neither of them covers
+// (approximately, overlaps are counted twice).
+static long
+merge_cost(const Rect &a, const Rect &b)
+{
+    return area(bounding_rect(a, b)) - area(a) - area(b);
+}
+
+struct PairCost {
+    double cost;
+    size_t i, j;
+    unsigned vi, vj;    // versions of i and j when the cost was taken
+
+    bool operator<(const PairCost &o) const { return cost > o.cost; }
+};
+
+// With waste >= 0 the cost is what the merge leaves unchanged beyond the
+// allowed share, a pair is worth merging below 0. Otherwise it's merge_cost.
+static double
+pair_cost(const Rect &a, const Rect &b, double waste)
+{
+    if (waste < 0)
+        return merge_cost(a, b);
+    return merge_cost(a, b) - waste*area(bounding_rect(a, b));
+}
+
+// Merges the cheapest pair first, from a queue of all pair costs. Merging
+// replaces i with the bounding rectangle and queues its new costs, entries
+// of rectangles that changed since are skipped. Stops when the cheapest
+// pair costs more than 0 (waste >= 0) or max_rects are left.
+static void
+merge_pairs(std::vector<Rect> &rects, double waste, size_t max_rects)
+{
+    size_t n = rects.size(), live = n;
+    std::vector<unsigned> version(n, 0);
+    std::vector<bool> alive(n, true);
+    std::priority_queue<PairCost> queue;
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = i + 1; j < n; j++) {
+            PairCost p = { pair_cost(rects[i], rects[j], waste), i, j, 0, 0 };
+            queue.push(p);
+        }
+    }
+
+    while (!queue.empty()) {
+        if (waste < 0 && live <= max_rects)
+            break;
+        PairCost p = queue.top();
+        queue.pop();
+        if (!alive[p.i] || !alive[p.j] || version[p.i] != p.vi || version[p.j] != p.vj)
+            continue;
+        if (waste >= 0 && p.cost > 0)
+            break;
+
+        rects[p.i] = bounding_rect(rects[p.i], rects[p.j]);
+        version[p.i]++;
+        alive[p.j] = false;
+        live--;
+        for (size_t k = 0; k < n; k++) {
+            if (!alive[k] || k == p.i)
+                continue;
+            size_t a = std::min(k, p.i), b = std::max(k, p.i);
+            PairCost q = { pair_cost(rects[a], rects[b], waste), a, b, version[a], version[b] };
+            queue.push(q);
+        }
+    }
+
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (alive[i])
+            rects[out++] = rects[i];
+    }
+    rects.resize(out);
+}
+
+// Merges rectangles whose bounding rectangle wouldn't be more than
+// merge_waste unchanged, then keeps merging the cheapest pairs until there
+// are no more than max_rects. Rectangles inside others merge at no cost.
+void
+merge_rects(std::vector<Rect> &rects, const diff_options &opts)
+{
+    merge_pairs(rects, opts.merge_waste, 0);
+    if (opts.max_rects > 0)
+        merge_pairs(rects, -1, opts.max_rects);
+}
+
+// Runs of dirty tiles in a tile row become one rectangle (in tile units),
+// runs with the same span in following tile rows are joined with it.
+static void
+tile_runs(const std::vector<unsigned char> &dirty, int tiles_x, int tiles_y,
+    std::vector<Rect> &rects)
+{
+    rects.clear();
+    // Rectangles that still touch the previous tile row.
+    std::vector<size_t> open, next_open;
+
+    for (int ty = 0; ty < tiles_y; ty++) {
+        const unsigned char *row = &dirty[(size_t)ty*tiles_x];
+        next_open.clear();
+        for (int tx = 0; tx < tiles_x; ) {
+            if (!row[tx]) {
+                tx++;
+                continue;
+            }
+            int start = tx;
+            while (tx < tiles_x && row[tx])
+                tx++;
+
+            size_t k;
+            for (k = 0; k < open.size(); k++) {
+                Rect &r = rects[open[k]];
+                if (r.x == start && r.w == tx - start)
+                    break;
+            }
+            if (k < open.size()) {
+                rects[open[k]].h++;
+                next_open.push_back(open[k]);
+            }
+            else {
+                rects.push_back(Rect(start, ty, tx - start, 1));
+                next_open.push_back(rects.size() - 1);
+            }
+        }
+        open.swap(next_open);
+    }
+}
+
+// Compares two frames tile by tile and returns the changed areas as
+// rectangles, merged by merge_rects. Noisy changes can give thousands of
+// runs, too many to merge pairwise, so the tiles are made coarser (2x2 into
+// 1) until there are at most MAX_RUNS.
+void
+find_dirty_rects(const unsigned char *prev, const unsigned char *cur, int width,
+    int height, int bpp, const diff_options &opts, std::vector<Rect> &rects)
+{
+    rects.clear();
+    if (width <= 0 || height <= 0)
+        return;
+
+    // A tile bigger than the frame is the frame, clamping keeps the tile
+    // math below from overflowing.
+    int ts = std::min(opts.tile_size, std::max(width, height));
+    int tiles_x = (width - 1)/ts + 1, tiles_y = (height - 1)/ts + 1;
+    long stride = (long)width*bpp;
+    std::vector<unsigned char> dirty((size_t)tiles_x*tiles_y);
+
+    for (int ty = 0; ty < tiles_y; ty++) {
+        unsigned char *row = &dirty[(size_t)ty*tiles_x];
+        int left = tiles_x;
+        int y_end = std::min(height, (ty + 1)*ts);
+        for (int y = ty*ts; y < y_end && left > 0; y++) {
+            for (int tx = 0; tx < tiles_x; tx++) {
+                if (row[tx])
+                    continue;
+                int x = tx*ts;
+                long off = y*stride + (long)x*bpp;
+                int len = std::min(ts, width - x)*bpp;
+                if (!bytes_equal(prev + off, cur + off, len)) {
+                    row[tx] = 1;
+                    left--;
+                }
+            }
+        }
+    }
+
+    tile_runs(dirty, tiles_x, tiles_y, rects);
+    while (rects.size() > MAX_RUNS) {
+        int cx = (tiles_x + 1)/2, cy = (tiles_y + 1)/2;
+        std::vector<unsigned char> coarse((size_t)cx*cy);
+        for (int ty = 0; ty < tiles_y; ty++) {
+            for (int tx = 0; tx < tiles_x; tx++)
+                coarse[(size_t)(ty/2)*cx + tx/2] |= dirty[(size_t)ty*tiles_x + tx];
+        }
+        dirty.swap(coarse);
+        tiles_x = cx;
+        tiles_y = cy;
+        ts *= 2;
+        tile_runs(dirty, tiles_x, tiles_y, rects);
+    }
+
+    for (size_t i = 0; i < rects.size(); i++) {
+        Rect &r = rects[i];
+        int x2 = std::min(width, (r.x + r.w)*ts), y2 = std::min(height, (r.y + r.h)*ts);
+        r = Rect(r.x*ts, r.y*ts, x2 - r.x*ts, y2 - r.y*ts);
+    }
+    merge_rects(rects, opts);
+}
+
+const char *
+parse_diff_options(Handle<Value> val, diff_options &opts)
+{
+    HandleScope scope;
+
+    if (val->IsUndefined())
+        return NULL;
+    if (!val->IsObject())
+        return "Diff options must be an object.";
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> tile_size = obj->Get(String::NewSymbol("tileSize"));
+    if (!tile_size->IsUndefined()) {
+        if (!tile_size->IsInt32() || tile_size->Int32Value() < 1)
+            return "Option 'tileSize' must be a positive integer.";
+        opts.tile_size = tile_size->Int32Value();
+    }
+
+    Local<Value> merge_waste = obj->Get(String::NewSymbol("mergeWaste"));
+    if (!merge_waste->IsUndefined()) {
+        if (!merge_waste->IsNumber() || merge_waste->NumberValue() < 0 ||
+            merge_waste->NumberValue() > 1)
+        {
+            return "Option 'mergeWaste' must be a number from 0 to 1.";
+        }
+        opts.merge_waste = merge_waste->NumberValue();
+    }
+
+    Local<Value> max_rects = obj->Get(String::NewSymbol("maxRects"));
+    if (!max_rects->IsUndefined()) {
+        if (!max_rects->IsInt32() || max_rects->Int32Value() < 0)
+            return "Option 'maxRects' must be a non-negative integer.";
+        opts.max_rects = max_rects->Int32Value();
+    }
+    return NULL;
+}
+
+Handle<Value>
+FrameDiff::Diff(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 5)
+        return VException("At least five arguments required - previous frame, current frame, width, height, buffer type [and diff options].");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+    if (!Buffer::HasInstance(args[1]))
+        return VException("Second argument must be Buffer.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return VException("Fourth argument must be integer height.");
+
+    buffer_type buf_type;
+    if (!args[4]->IsString() || !parse_buffer_type(*String::AsciiValue(args[4]), buf_type))
+        return VException("Fifth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+
+    diff_options opts;
+    if (args.Length() >= 6) {
+        const char *err = parse_diff_options(args[5], opts);
+        if (err) return VException(err);
+    }
+
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+    if (w < 0)
+        return VException("Width smaller than 0.");
+    if (h < 0)
+        return VException("Height smaller than 0.");
+
+    int bpp = bytes_per_pixel(buf_type, 8);
+    Local<Object> prev = args[0]->ToObject(), cur = args[1]->ToObject();
+    if (BufferLength(prev) < (size_t)w*h*bpp || BufferLength(cur) < (size_t)w*h*bpp)
+        return VException("Buffers too small for given width and height.");
+
+    std::vector<Rect> rects;
+    find_dirty_rects((unsigned char *)BufferData(prev), (unsigned char *)BufferData(cur),
+        w, h, bpp, opts, rects);
+
+    Local<Array> result = Array::New(rects.size());
+    for (size_t i = 0; i < rects.size(); i++) {
+        Local<Object> r = Object::New();
+        r->Set(String::NewSymbol("x"), Integer::New(rects[i].x));
+        r->Set(String::NewSymbol("y"), Integer::New(rects[i].y));
+        r->Set(String::NewSymbol("w"), Integer::New(rects[i].w));
+        r->Set(String::NewSymbol("h"), Integer::New(rects[i].h));
+        result->Set(i, r);
+    }
+    return scope.Close(result);
+}
@@ -0,0 +1,31 @@
+#ifndef FRAME_DIFF_H
+#define FRAME_DIFF_H
+
+#include <node.h>
+
+#include <vector>
+
+#include "common.h"
+
+struct diff_options {
+    int tile_size;      // frames are compared in tile_size x tile_size blocks
+    double merge_waste; // unchanged share of a merged rectangle that's fine
+    int max_rects;      // merge until there are at most this many, 0 for no limit
+
+    diff_options() : tile_size(16), merge_waste(0.25), max_rects(0) {}
+};
+
+bool bytes_equal(const unsigned char *a, const unsigned char *b, int len);
+void find_dirty_rects(const unsigned char *prev, const unsigned char *cur, int width,
+    int height, int bpp, const diff_options &opts, std::vector<Rect> &rects);
+void merge_rects(std::vector<Rect> &rects, const diff_options &opts);
+const char *parse_diff_options(v8::Handle<v8::Value> val, diff_options &opts);
+
+// png.diff(prev, cur, width, height, type, [opts])
+class FrameDiff {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    static v8::Handle<v8::Value> Diff(const v8::Arguments &args);
+};
+
+#endif
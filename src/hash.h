@@ -0,0 +1,9 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <cstddef>
+
+uint64_t hash_bytes(const unsigned char *data, size_t len, uint64_t seed);
+
+#endif
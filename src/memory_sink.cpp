@@ -0,0 +1,27 @@
+#include <cstring>
+
+#include "memory_sink.h"
+
+MemorySink::MemorySink(char *ddst, size_t ccapacity) :
+    dst(ddst), capacity(ccapacity), len(0) {}
+
+void
+MemorySink::write(const char *data, unsigned int llen)
+{
+    if (len + llen <= capacity)
+        memcpy(dst + len, data, llen);
+    len += llen;
+}
+
+bool
+MemorySink::fits() const
+{
+    return len <= capacity;
+}
+
+// The bytes written, or needed if the PNG didn't fit.
+size_t
+MemorySink::length() const
+{
+    return len;
+}
@@ -0,0 +1,20 @@
+#ifndef MEMORY_SINK_H
+#define MEMORY_SINK_H
+
+#include "png_encoder.h"
+
+// Writes the PNG into memory the caller owns. If it doesn't fit the rest is
+// only counted, so the size the PNG needs is known after the encode.
+class MemorySink : public PngSink {
+    char *dst;
+    size_t capacity, len;
+
+public:
+    MemorySink(char *ddst, size_t ccapacity);
+
+    void write(const char *data, unsigned int llen);
+    bool fits() const;
+    size_t length() const;
+};
+
+#endif
@@ -1,16 +1,36 @@
 #include <node.h>
 
+#include "buffer_pool.h"
+#include "file_sink.h"
 #include "png.h"
+#include "png_read_stream.h"
+#include "png_encode_stream.h"
+#include "png_decoder.h"
 #include "fixed_png_stack.h"
 #include "dynamic_png_stack.h"
+#include "encoder_session.h"
+#include "png_cache.h"
+#include "frame_diff.h"
+#include "motion_detect.h"
 
 extern "C" void
 init(v8::Handle<v8::Object> target)
 {
     v8::HandleScope scope;
 
+    BufferPool::Initialize(target);
+    FileSink::Initialize();
     Png::Initialize(target);
+    PngReadStream::Initialize(target);
+    PngEncodeStream::Initialize(target);
+    PngDecoder::Initialize(target);
     FixedPngStack::Initialize(target);
     DynamicPngStack::Initialize(target);
+    EncoderSession::Initialize(target);
+    PngCache::Initialize(target);
+    FrameDiff::Initialize(target);
+    MotionDetect::Initialize(target);
 }
 
+NODE_MODULE(png, init)
+
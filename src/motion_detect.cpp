@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <utility>
+
+#include "motion_detect.h"
+#include "hash.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+void
+MotionDetect::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    NODE_SET_METHOD(target, "detectMotion", DetectMotion);
+}
+
+typedef std::pair<uint64_t, int> HashPos;
+
+// Finds the shift that takes the most lines (rows or columns) of the
+// previous frame to lines of the current one. Only lines that changed in
+// place and whose hash is unique in the previous frame vote, so blank lines
+// don't count.
+static bool
+find_shift(const std::vector<uint64_t> &prev, const std::vector<uint64_t> &cur,
+    int min_votes, int &shift)
+{
+    int n = prev.size();
+    std::vector<HashPos> sorted(n);
+    for (int i = 0; i < n; i++)
+        sorted[i] = HashPos(prev[i], i);
+    std::sort(sorted.begin(), sorted.end());
+
+    std::vector<int> votes(2*n + 1, 0);
+    for (int i = 0; i < n; i++) {
+        if (cur[i] == prev[i])
+            continue;
+        std::vector<HashPos>::iterator it =
+            std::lower_bound(sorted.begin(), sorted.end(), HashPos(cur[i], -1));
+        if (it == sorted.end() || it->first != cur[i])
+            continue;
+        if (it + 1 != sorted.end() && (it + 1)->first == cur[i])
+            continue;
+        votes[i - it->second + n]++;
+    }
+
+    int best = n;
+    for (int i = 0; i < 2*n + 1; i++) {
+        if (votes[i] > votes[best])
+            best = i;
+    }
+    shift = best - n;
+    return shift != 0 && votes[best] >= min_votes;
+}
+
+// Splits the lines that match the previous frame's lines shifted by shift
+// into bands, keeping those that explain at least min_rows changed lines.
+// match and changed are indexed by the line in the current frame.
+static void
+find_bands(const std::vector<unsigned char> &match, const std::vector<unsigned char> &changed,
+    int min_rows, std::vector<std::pair<int, int> > &bands)
+{
+    int n = match.size();
+    for (int i = 0; i < n; ) {
+        if (!match[i]) {
+            i++;
+            continue;
+        }
+        int start = i, count = 0;
+        for (; i < n && match[i]; i++)
+            count += changed[i];
+        if (count >= min_rows)
+            bands.push_back(std::make_pair(start, i));
+    }
+}
+
+static void
+vertical_copies(const unsigned char *prev, const unsigned char *cur, int width, int height,
+    int bpp, const motion_options &opts, std::vector<CopyRect> &copies)
+{
+    long stride = (long)width*bpp;
+    std::vector<uint64_t> prev_h(height), cur_h(height);
+    for (int y = 0; y < height; y++) {
+        prev_h[y] = hash_bytes(prev + y*stride, stride, 0);
+        cur_h[y] = hash_bytes(cur + y*stride, stride, 0);
+    }
+
+    int dy;
+    if (!find_shift(prev_h, cur_h, opts.min_rows, dy))
+        return;
+
+    std::vector<unsigned char> match(height, 0), changed(height, 0);
+    for (int y = std::max(0, dy); y < std::min(height, height + dy); y++) {
+        match[y] = cur_h[y] == prev_h[y - dy] &&
+            bytes_equal(cur + y*stride, prev + (y - dy)*stride, stride);
+        changed[y] = cur_h[y] != prev_h[y];
+    }
+
+    std::vector<std::pair<int, int> > bands;
+    find_bands(match, changed, opts.min_rows, bands);
+    for (size_t i = 0; i < bands.size(); i++) {
+        int y0 = bands[i].first, y1 = bands[i].second;
+        copies.push_back(CopyRect(0, y0 - dy, Rect(0, y0, width, y1 - y0)));
+    }
+}
+
+static void
+column_hashes(const unsigned char *data, int width, int height, int bpp,
+    std::vector<uint64_t> &hashes)
+{
+    // FNV-1a down every column, a row at a time to stay cache friendly.
+    hashes.assign(width, 14695981039346656037ULL);
+    for (int y = 0; y < height; y++) {
+        const unsigned char *p = data + (long)y*width*bpp;
+        for (int x = 0; x < width; x++) {
+            uint64_t h = hashes[x];
+            for (int b = 0; b < bpp; b++)
+                h = (h ^ *p++) * 1099511628211ULL;
+            hashes[x] = h;
+        }
+    }
+}
+
+static bool
+columns_equal(const unsigned char *a, const unsigned char *b, int ax, int bx, int width,
+    int height, int bpp)
+{
+    for (int y = 0; y < height; y++) {
+        long row = (long)y*width*bpp;
+        if (memcmp(a + row + ax*bpp, b + row + bx*bpp, bpp))
+            return false;
+    }
+    return true;
+}
+
+static void
+horizontal_copies(const unsigned char *prev, const unsigned char *cur, int width, int height,
+    int bpp, const motion_options &opts, std::vector<CopyRect> &copies)
+{
+    std::vector<uint64_t> prev_h, cur_h;
+    column_hashes(prev, width, height, bpp, prev_h);
+    column_hashes(cur, width, height, bpp, cur_h);
+
+    int dx;
+    if (!find_shift(prev_h, cur_h, opts.min_rows, dx))
+        return;
+
+    std::vector<unsigned char> match(width, 0), changed(width, 0);
+    for (int x = std::max(0, dx); x < std::min(width, width + dx); x++) {
+        match[x] = cur_h[x] == prev_h[x - dx] &&
+            columns_equal(cur, prev, x, x - dx, width, height, bpp);
+        changed[x] = cur_h[x] != prev_h[x];
+    }
+
+    std::vector<std::pair<int, int> > bands;
+    find_bands(match, changed, opts.min_rows, bands);
+    for (size_t i = 0; i < bands.size(); i++) {
+        int x0 = bands[i].first, x1 = bands[i].second;
+        copies.push_back(CopyRect(x0 - dx, 0, Rect(x0, 0, x1 - x0, height)));
+    }
+}
+
+// Looks for content of the previous frame that moved (a scrolling terminal
+// or document) and returns it as copies, plus the rectangles that still
+// changed once the copies are applied. Vertical shifts are tried first,
+// horizontal ones only if asked for and there was no vertical one.
+void
+detect_motion(const unsigned char *prev, const unsigned char *cur, int width,
+    int height, int bpp, const motion_options &opts, std::vector<CopyRect> &copies,
+    std::vector<Rect> &rects)
+{
+    copies.clear();
+    vertical_copies(prev, cur, width, height, bpp, opts, copies);
+    if (copies.empty() && opts.horizontal)
+        horizontal_copies(prev, cur, width, height, bpp, opts, copies);
+
+    if (copies.empty()) {
+        find_dirty_rects(prev, cur, width, height, bpp, opts.diff, rects);
+        return;
+    }
+
+    // What the client has after the copies, the residual is diffed
+    // against that.
+    long stride = (long)width*bpp;
+    std::vector<unsigned char> moved(prev, prev + stride*height);
+    for (size_t i = 0; i < copies.size(); i++) {
+        const CopyRect &c = copies[i];
+        for (int y = 0; y < c.dst.h; y++) {
+            memcpy(&moved[(c.dst.y + y)*stride + c.dst.x*bpp],
+                prev + (c.src_y + y)*stride + c.src_x*bpp, c.dst.w*bpp);
+        }
+    }
+    find_dirty_rects(&moved[0], cur, width, height, bpp, opts.diff, rects);
+}
+
+static const char *
+parse_motion_options(Handle<Value> val, motion_options &opts)
+{
+    HandleScope scope;
+
+    const char *err = parse_diff_options(val, opts.diff);
+    if (err || val->IsUndefined())
+        return err;
+
+    Local<Object> obj = val->ToObject();
+    Local<Value> min_rows = obj->Get(String::NewSymbol("minRows"));
+    if (!min_rows->IsUndefined()) {
+        if (!min_rows->IsInt32() || min_rows->Int32Value() < 1)
+            return "Option 'minRows' must be a positive integer.";
+        opts.min_rows = min_rows->Int32Value();
+    }
+
+    Local<Value> horizontal = obj->Get(String::NewSymbol("horizontal"));
+    if (!horizontal->IsUndefined()) {
+        if (!horizontal->IsBoolean())
+            return "Option 'horizontal' must be true or false.";
+        opts.horizontal = horizontal->BooleanValue();
+    }
+    return NULL;
+}
+
+static Local<Object>
+rect_object(const Rect &rect)
+{
+    Local<Object> r = Object::New();
+    r->Set(String::NewSymbol("x"), Integer::New(rect.x));
+    r->Set(String::NewSymbol("y"), Integer::New(rect.y));
+    r->Set(String::NewSymbol("w"), Integer::New(rect.w));
+    r->Set(String::NewSymbol("h"), Integer::New(rect.h));
+    return r;
+}
+
+Handle<Value>
+MotionDetect::DetectMotion(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 5)
+        return VException("At least five arguments required - previous frame, current frame, width, height, buffer type [and options].");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+    if (!Buffer::HasInstance(args[1]))
+        return VException("Second argument must be Buffer.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer width.");
+    if (!args[3]->IsInt32())
+        return VException("Fourth argument must be integer height.");
+
+    buffer_type buf_type;
+    if (!args[4]->IsString() || !parse_buffer_type(*String::AsciiValue(args[4]), buf_type))
+        return VException("Fifth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+
+    motion_options opts;
+    if (args.Length() >= 6) {
+        const char *err = parse_motion_options(args[5], opts);
+        if (err) return VException(err);
+    }
+
+    int w = args[2]->Int32Value();
+    int h = args[3]->Int32Value();
+    if (w < 0)
+        return VException("Width smaller than 0.");
+    if (h < 0)
+        return VException("Height smaller than 0.");
+
+    int bpp = bytes_per_pixel(buf_type, 8);
+    Local<Object> prev = args[0]->ToObject(), cur = args[1]->ToObject();
+    if (BufferLength(prev) < (size_t)w*h*bpp || BufferLength(cur) < (size_t)w*h*bpp)
+        return VException("Buffers too small for given width and height.");
+
+    std::vector<CopyRect> copies;
+    std::vector<Rect> rects;
+    detect_motion((unsigned char *)BufferData(prev), (unsigned char *)BufferData(cur),
+        w, h, bpp, opts, copies, rects);
+
+    Local<Array> copies_arr = Array::New(copies.size());
+    for (size_t i = 0; i < copies.size(); i++) {
+        Local<Object> c = rect_object(copies[i].dst);
+        c->Set(String::NewSymbol("srcX"), Integer::New(copies[i].src_x));
+        c->Set(String::NewSymbol("srcY"), Integer::New(copies[i].src_y));
+        copies_arr->Set(i, c);
+    }
+
+    Local<Array> rects_arr = Array::New(rects.size());
+    for (size_t i = 0; i < rects.size(); i++)
+        rects_arr->Set(i, rect_object(rects[i]));
+
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("copies"), copies_arr);
+    result->Set(String::NewSymbol("rects"), rects_arr);
+    return scope.Close(result);
+}
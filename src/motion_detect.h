@@ -0,0 +1,39 @@
+#ifndef MOTION_DETECT_H
+#define MOTION_DETECT_H
+
+#include <node.h>
+
+#include <vector>
+
+#include "common.h"
+#include "frame_diff.h"
+
+struct motion_options {
+    diff_options diff;  // for the rectangles left after the copies
+    int min_rows;       // changed rows (or columns) a shift has to explain
+    bool horizontal;    // also look for horizontal shifts
+
+    motion_options() : min_rows(8), horizontal(false) {}
+};
+
+// Copy w x h pixels from (src_x, src_y) of the previous frame to (x, y).
+struct CopyRect {
+    int src_x, src_y;
+    Rect dst;
+
+    CopyRect(int ssrc_x, int ssrc_y, const Rect &ddst) :
+        src_x(ssrc_x), src_y(ssrc_y), dst(ddst) {}
+};
+
+void detect_motion(const unsigned char *prev, const unsigned char *cur, int width,
+    int height, int bpp, const motion_options &opts, std::vector<CopyRect> &copies,
+    std::vector<Rect> &rects);
+
+// png.detectMotion(prev, cur, width, height, type, [opts])
+class MotionDetect {
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    static v8::Handle<v8::Value> DetectMotion(const v8::Arguments &args);
+};
+
+#endif
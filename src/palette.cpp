@@ -0,0 +1,153 @@
+#include "palette.h"
+
+static inline unsigned int
+hash_color(unsigned int color)
+{
+    return (color * 2654435761U) >> 22;
+}
+
+Palette::Palette() : count(0)
+{
+    for (int i = 0; i < TABLE_SIZE; i++)
+        slots[i] = -1;
+}
+
+// Returns the index of color, adding it if it's new. Returns -1 once the
+// palette already has 256 colors and this one isn't among them.
+int
+Palette::add(unsigned int color)
+{
+    unsigned int h = hash_color(color);
+    while (slots[h] != -1) {
+        if (keys[h] == color)
+            return slots[h];
+        h = (h + 1) & (TABLE_SIZE - 1);
+    }
+    if (count == 256)
+        return -1;
+
+    keys[h] = color;
+    slots[h] = count;
+    colors[count] = color;
+    return count++;
+}
+
+int
+Palette::lookup(unsigned int color) const
+{
+    unsigned int h = hash_color(color);
+    while (slots[h] != -1) {
+        if (keys[h] == color)
+            return slots[h];
+        h = (h + 1) & (TABLE_SIZE - 1);
+    }
+    return -1;
+}
+
+int
+Palette::size() const
+{
+    return count;
+}
+
+unsigned int
+Palette::color(int index) const
+{
+    return colors[index];
+}
+
+// Collects the colors of the buffer. Gives up as soon as the 257th color is
+// seen and returns false. Runs of the same pixel only cost a compare.
+bool
+Palette::build(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, const unsigned int *color_key)
+{
+    int bpp = bytes_per_pixel(buf_type, 8);
+    unsigned int prev = 0;
+    bool first = true;
+    for (int y = 0; y < height; y++) {
+        const unsigned char *p = data + (long)y*stride;
+        for (int x = 0; x < width; x++, p += bpp) {
+            unsigned int c = pack_pixel(p, buf_type);
+            if (!first && c == prev)
+                continue;
+            first = false;
+            prev = c;
+            if (color_key && c == *color_key)
+                c &= 0x00FFFFFF;
+            if (add(c) == -1)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Writes the palette index of each pixel in src to dst, one byte per pixel.
+void
+Palette::index_row(const unsigned char *src, int width, buffer_type buf_type,
+    const unsigned int *color_key, unsigned char *dst) const
+{
+    int bpp = bytes_per_pixel(buf_type, 8);
+    unsigned int prev = 0;
+    int index = 0;
+    for (int x = 0; x < width; x++, src += bpp) {
+        unsigned int c = pack_pixel(src, buf_type);
+        if (x == 0 || c != prev) {
+            prev = c;
+            if (color_key && c == *color_key)
+                c &= 0x00FFFFFF;
+            index = lookup(c);
+        }
+        *dst++ = index;
+    }
+}
+
+// Moves the colors that aren't fully opaque to the front so that the tRNS
+// chunk only has to list those.
+void
+Palette::sort_by_alpha()
+{
+    int new_index[256];
+    unsigned int sorted[256];
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if ((colors[i] >> 24) != 0xFF) {
+            new_index[i] = n;
+            sorted[n++] = colors[i];
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if ((colors[i] >> 24) == 0xFF) {
+            new_index[i] = n;
+            sorted[n++] = colors[i];
+        }
+    }
+    memcpy(colors, sorted, sizeof(*colors) * count);
+    for (int i = 0; i < TABLE_SIZE; i++) {
+        if (slots[i] != -1)
+            slots[i] = new_index[slots[i]];
+    }
+}
+
+// Smallest bit depth that can index all the colors.
+int
+Palette::bit_depth() const
+{
+    if (count <= 2) return 1;
+    if (count <= 4) return 2;
+    if (count <= 16) return 4;
+    return 8;
+}
+
+// Number of leading entries that need a tRNS value, see sort_by_alpha.
+int
+Palette::trans_count() const
+{
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if ((colors[i] >> 24) != 0xFF)
+            n = i + 1;
+    }
+    return n;
+}
+
@@ -0,0 +1,55 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include "common.h"
+
+// Packs an 8 bit pixel as r, g, b and PNG alpha from the lowest byte up.
+// Input alpha is inverted (0x00 is opaque), see png_set_invert_alpha.
+static inline unsigned int
+pack_pixel(const unsigned char *p, buffer_type buf_type)
+{
+    switch (buf_type) {
+    case BUF_RGB:
+        return p[0] | (p[1] << 8) | (p[2] << 16) | 0xFF000000U;
+    case BUF_BGR:
+        return p[2] | (p[1] << 8) | (p[0] << 16) | 0xFF000000U;
+    case BUF_RGBA:
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)(0xFF - p[3]) << 24);
+    case BUF_BGRA:
+        return p[2] | (p[1] << 8) | (p[0] << 16) | ((unsigned int)(0xFF - p[3]) << 24);
+    case BUF_GRAYA:
+        return p[0] | (p[0] << 8) | (p[0] << 16) | ((unsigned int)(0xFF - p[1]) << 24);
+    default:
+        return p[0] | (p[0] << 8) | (p[0] << 16) | 0xFF000000U;
+    }
+}
+
+// Exact palette of at most 256 colors, built with a small open addressing
+// hash table keyed on the packed pixel value.
+class Palette {
+    static const int TABLE_SIZE = 1024;
+
+    unsigned int keys[TABLE_SIZE];
+    short slots[TABLE_SIZE];
+    unsigned int colors[256];
+    int count;
+
+public:
+    Palette();
+
+    int add(unsigned int color);
+    int lookup(unsigned int color) const;
+    int size() const;
+    unsigned int color(int index) const;
+
+    bool build(const unsigned char *data, int width, int height, int stride,
+        buffer_type buf_type, const unsigned int *color_key);
+    void index_row(const unsigned char *src, int width, buffer_type buf_type,
+        const unsigned int *color_key, unsigned char *dst) const;
+    void sort_by_alpha();
+    int bit_depth() const;
+    int trans_count() const;
+};
+
+#endif
+
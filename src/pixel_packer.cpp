@@ -0,0 +1,95 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pixel_packer.h"
+
+#ifdef __SSE2__
+// movemask gives the first pixel in the lowest bit but PNG wants it in the
+// highest.
+static inline unsigned char
+reverse_bits(unsigned int b)
+{
+    return ((b * 0x0202020202ULL) & 0x010884422010ULL) % 1023;
+}
+
+// Joins neighbouring bytes of v: (even << shift) | odd, two bytes into one,
+// leaving the result in the low 8 bytes.
+static inline __m128i
+join_pairs(__m128i v, int shift)
+{
+    __m128i lo = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+    __m128i hi = _mm_srli_epi16(v, 8);
+    __m128i joined = _mm_or_si128(_mm_sll_epi16(lo, _mm_cvtsi32_si128(shift)), hi);
+    return _mm_packus_epi16(joined, joined);
+}
+#endif
+
+// Packs one value per byte (each less than 1 << depth) into depth bits per
+// pixel, first pixel in the highest bits as PNG wants it. src and dst may be
+// the same buffer.
+void
+pack_pixels(const unsigned char *src, unsigned char *dst, int width, int depth)
+{
+    int x = 0;
+    unsigned char *out = dst;
+
+#ifdef __SSE2__
+    if (depth == 1) {
+        for (; x + 16 <= width; x += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+            int bits = _mm_movemask_epi8(_mm_slli_epi16(v, 7));
+            *out++ = reverse_bits(bits & 0xFF);
+            *out++ = reverse_bits(bits >> 8);
+        }
+    }
+    else if (depth == 2) {
+        for (; x + 32 <= width; x += 32) {
+            __m128i a = join_pairs(_mm_loadu_si128((const __m128i *)(src + x)), 2);
+            __m128i b = join_pairs(_mm_loadu_si128((const __m128i *)(src + x + 16)), 2);
+            __m128i v = join_pairs(_mm_unpacklo_epi64(a, b), 4);
+            _mm_storel_epi64((__m128i *)out, v);
+            out += 8;
+        }
+    }
+    else if (depth == 4) {
+        for (; x + 16 <= width; x += 16) {
+            __m128i v = join_pairs(_mm_loadu_si128((const __m128i *)(src + x)), 4);
+            _mm_storel_epi64((__m128i *)out, v);
+            out += 8;
+        }
+    }
+#endif
+
+    int per_byte = 8 / depth;
+    for (; x < width; x += per_byte) {
+        unsigned char b = 0;
+        for (int k = 0; k < per_byte; k++) {
+            b <<= depth;
+            if (x + k < width)
+                b |= src[x + k];
+        }
+        *out++ = b;
+    }
+}
+
+
+// Swaps the bytes of count 16 bit values, for little endian input (PNG
+// samples are big endian). src and dst may be the same buffer.
+void
+swap_bytes16(const unsigned char *src, unsigned char *dst, long count)
+{
+    long i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i*2));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i*2), v);
+    }
+#endif
+    for (; i < count; i++) {
+        unsigned char hi = src[i*2 + 1];
+        dst[i*2 + 1] = src[i*2];
+        dst[i*2] = hi;
+    }
+}
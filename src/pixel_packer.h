@@ -0,0 +1,8 @@
+#ifndef PIXEL_PACKER_H
+#define PIXEL_PACKER_H
+
+void pack_pixels(const unsigned char *src, unsigned char *dst, int width, int depth);
+void swap_bytes16(const unsigned char *src, unsigned char *dst, long count);
+
+#endif
+
@@ -1,8 +1,19 @@
 #include <cstring>
 #include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
 #include "common.h"
 #include "png_encoder.h"
 #include "png.h"
+#include "png_read_stream.h"
+#include "png_encode_stream.h"
+#include "file_sink.h"
+#include "memory_sink.h"
+#include "buffer_pool.h"
+#include "size_estimator.h"
+#include "png_probe.h"
 #include "buffer_compat.h"
 
 using namespace v8;
@@ -17,14 +28,27 @@ Png::Initialize(Handle<Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", PngEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", PngEncodeSync);
-    target->Set(String::NewSymbol("Png"), t->GetFunction());
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeInfo", EncodeInfo);
+    NODE_SET_PROTOTYPE_METHOD(t, "createReadStream", CreateReadStream);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeToFile", EncodeToFile);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeInto", EncodeInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "estimate", Estimate);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeIntoSync", EncodeIntoSync);
+
+    Local<Function> ctor = t->GetFunction();
+    NODE_SET_METHOD(ctor, "encodeRegions", EncodeRegions);
+    NODE_SET_METHOD(ctor, "createEncodeStream", PngEncodeStream::Create);
+    NODE_SET_METHOD(ctor, "probe", Probe);
+    target->Set(String::NewSymbol("Png"), ctor);
 }
 
-Png::Png(int wwidth, int hheight, buffer_type bbuf_type, int bbits) :
-    width(wwidth), height(hheight), buf_type(bbuf_type), bits(bbits) {}
+Png::Png(int wwidth, int hheight, buffer_type bbuf_type, int bbits, int sstride,
+    long ooffset) :
+    width(wwidth), height(hheight), buf_type(bbuf_type), bits(bbits), stride(sstride),
+    offset(ooffset) {}
 
 Handle<Value>
-Png::PngEncodeSync()
+Png::PngEncodeSync(const encode_options &opts)
 {
     HandleScope scope;
 
@@ -33,11 +57,15 @@ Png::PngEncodeSync()
     char *buf_data = BufferData(buf_val->ToObject());
 
     try {
-        PngEncoder encoder((unsigned char*)buf_data, width, height, buf_type, bits);
+        PngEncoder encoder((unsigned char*)buf_data + offset, width, height, buf_type, bits);
+        encoder.set_stride(stride);
+        encoder.set_options(opts);
         encoder.encode();
+        info = encoder.get_info();
         int png_len = encoder.get_png_len();
         Buffer *retbuf = Buffer::New(png_len);
         memcpy(BufferData(retbuf), encoder.get_png(), png_len);
+        BufferPool::report_external();
         return scope.Close(retbuf->handle_);
     }
     catch (const char *err) {
@@ -51,7 +79,7 @@ Png::New(const Arguments &args)
     HandleScope scope;
 
     if (args.Length() < 3)
-        return VException("At least three arguments required - data buffer, width, height, [and input buffer type]");
+        return VException("At least three arguments required - data buffer, width, height, [input buffer type, bit width, stride and region]");
     if (!Buffer::HasInstance(args[0]))
         return VException("First argument must be Buffer.");
     if (!args[1]->IsInt32())
@@ -62,14 +90,14 @@ Png::New(const Arguments &args)
     buffer_type buf_type = BUF_RGB;
     if (args.Length() >= 4) {
         if (!args[3]->IsString())
-            return VException("Fourth argument must be 'gray', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Fourth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
 
         String::AsciiValue bts(args[3]->ToString());
         if (!(str_eq(*bts, "rgb") || str_eq(*bts, "bgr") ||
             str_eq(*bts, "rgba") || str_eq(*bts, "bgra") ||
-            str_eq(*bts, "gray")))
+            str_eq(*bts, "gray") || str_eq(*bts, "graya")))
         {
-            return VException("Fourth argument must be 'gray', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Fourth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
         }
         
         if (str_eq(*bts, "rgb"))
@@ -82,15 +110,15 @@ Png::New(const Arguments &args)
             buf_type = BUF_BGRA;
         else if (str_eq(*bts, "gray"))
             buf_type = BUF_GRAY;
+        else if (str_eq(*bts, "graya"))
+            buf_type = BUF_GRAYA;
         else
-            return VException("Fourth argument wasn't 'gray', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+            return VException("Fourth argument wasn't 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
     }
 
     int bits = 8;
 
-    if (args.Length() >= 5) {
-        if(buf_type != BUF_GRAY)
-            return VException("Pixel bit width option only valid for \"gray\" buffer type");
+    if (args.Length() >= 5 && !args[4]->IsUndefined()) {
         if(!args[4]->IsInt32())
             return VException("Fifth argument must be 8 or 16");
 
@@ -111,7 +139,29 @@ Png::New(const Arguments &args)
     if (h < 0)
         return VException("Height smaller than 0.");
 
-    Png *png = new Png(w, h, buf_type, bits);
+    int row_len = row_length(w, bytes_per_pixel(buf_type, bits));
+    if (row_len < 0)
+        return VException("Width too large.");
+    int stride = row_len;
+    if (args.Length() >= 6 && !args[5]->IsUndefined()) {
+        if (!args[5]->IsInt32())
+            return VException("Sixth argument must be integer stride.");
+        stride = args[5]->Int32Value();
+        if (stride < row_len)
+            return VException("Stride smaller than width times bytes per pixel.");
+    }
+    if (!rows_fit(BufferLength(args[0]->ToObject()), h, stride, row_len))
+        return VException("Buffer too small for given width, height and stride.");
+
+    // Only the region gets encoded, straight from the buffer.
+    Rect roi(0, 0, w, h);
+    if (args.Length() >= 7 && !args[6]->IsUndefined()) {
+        const char *err = parse_rect(args[6], w, h, roi);
+        if (err) return VException(err);
+    }
+    long offset = (long)roi.y*stride + (long)roi.x*bytes_per_pixel(buf_type, bits);
+
+    Png *png = new Png(roi.w, roi.h, buf_type, bits, stride, offset);
     png->Wrap(args.This());
 
     // Save buffer.
@@ -124,8 +174,69 @@ Handle<Value>
 Png::PngEncodeSync(const Arguments &args)
 {
     HandleScope scope;
+
+    encode_options opts;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+    return scope.Close(png->PngEncodeSync(opts));
+}
+
+Handle<Value>
+Png::CreateReadStream(const Arguments &args)
+{
+    HandleScope scope;
+
     Png *png = ObjectWrap::Unwrap<Png>(args.This());
-    return scope.Close(png->PngEncodeSync());
+    Local<Value> buf_val = png->handle_->GetHiddenValue(String::New("buffer"));
+
+    return scope.Close(PngReadStream::Create(png, png->handle_,
+        BufferData(buf_val->ToObject()), args.Length() >= 1 ? args[0] : Undefined()));
+}
+
+// png.estimate([opts]) predicts the size and encode time of the PNG from a
+// sample of the rows. Only the level option is taken into account.
+Handle<Value>
+Png::Estimate(const Arguments &args)
+{
+    HandleScope scope;
+
+    encode_options opts;
+    if (args.Length() >= 1) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
+
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+    Local<Value> buf_val = png->handle_->GetHiddenValue(String::New("buffer"));
+    unsigned char *data = (unsigned char *)BufferData(buf_val->ToObject()) + png->offset;
+
+    size_estimate est;
+    try {
+        estimate_size(data, png->width, png->height, png->stride, png->buf_type, png->bits,
+            opts.level, 64, est);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("bytes"), Number::New(floor(est.bytes)));
+    result->Set(String::NewSymbol("time"), Number::New(est.time));
+    result->Set(String::NewSymbol("entropy"), Number::New(est.entropy));
+    result->Set(String::NewSymbol("colors"), Integer::New(est.colors));
+    return scope.Close(result);
+}
+
+Handle<Value>
+Png::EncodeInfo(const Arguments &args)
+{
+    HandleScope scope;
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+    return scope.Close(encode_info_object(png->info));
 }
 
 void
@@ -135,17 +246,14 @@ Png::UV_PngEncode(uv_work_t* req)
     Png *png = (Png *)enc_req->png_obj;
 
     try {
-        PngEncoder encoder((unsigned char *)enc_req->buf_data, png->width, png->height, png->buf_type, png->bits);
+        PngEncoder encoder((unsigned char *)enc_req->buf_data + png->offset, png->width, png->height,
+            png->buf_type, png->bits);
+        encoder.set_stride(png->stride);
+        encoder.set_options(enc_req->opts);
         encoder.encode();
+        enc_req->info = encoder.get_info();
         enc_req->png_len = encoder.get_png_len();
-        enc_req->png = (char *)malloc(sizeof(*enc_req->png)*enc_req->png_len);
-        if (!enc_req->png) {
-            enc_req->error = strdup("malloc in Png::UV_PngEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->png, encoder.get_png(), enc_req->png_len);
-        }
+        enc_req->png = encoder.release_png();
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -167,6 +275,7 @@ Png::UV_PngEncodeAfter(uv_work_t *req)
         argv[1] = ErrorException(enc_req->error);
     }
     else {
+        ((Png *)enc_req->png_obj)->info = enc_req->info;
         Buffer *buf = Buffer::New(enc_req->png_len);
         memcpy(BufferData(buf), enc_req->png, enc_req->png_len);
         argv[0] = buf->handle_;
@@ -181,11 +290,13 @@ Png::UV_PngEncodeAfter(uv_work_t *req)
         FatalException(try_catch);
 
     enc_req->callback.Dispose();
-    free(enc_req->png);
+    unref_encode_options(enc_req->opts);
+    BufferPool::release(enc_req->png);
     free(enc_req->error);
 
     ((Png *)enc_req->png_obj)->Unref();
     free(enc_req);
+    BufferPool::report_external();
 }
 
 Handle<Value>
@@ -193,13 +304,19 @@ Png::PngEncodeAsync(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1)
-        return VException("One argument required - callback function.");
+    if (args.Length() < 1 || args.Length() > 2)
+        return VException("One or two arguments required - [encode options and] callback function.");
+
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
 
-    if (!args[0]->IsFunction())
-        return VException("First argument must be a function.");
+    encode_options opts;
+    if (args.Length() == 2) {
+        const char *err = parse_encode_options(args[0], opts);
+        if (err) return VException(err);
+    }
 
-    Local<Function> callback = Local<Function>::Cast(args[0]);
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
     Png *png = ObjectWrap::Unwrap<Png>(args.This());
 
     encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
@@ -211,6 +328,9 @@ Png::PngEncodeAsync(const Arguments &args)
     enc_req->png = NULL;
     enc_req->png_len = 0;
     enc_req->error = NULL;
+    enc_req->opts = opts;
+    enc_req->info = encode_info();
+    ref_encode_options(opts);
 
     // We need to pull out the buffer data before
     // we go to the thread pool.
@@ -228,4 +348,563 @@ Png::PngEncodeAsync(const Arguments &args)
     return Undefined();
 }
 
-NODE_MODULE(png, Png::Initialize)
+// Png.encodeRegions encodes every region as a separate job in the thread
+// pool, all reading from the same buffer. The callback gets called once the
+// last one is done.
+struct region_batch;
+
+struct region_job {
+    region_batch *batch;
+    Rect rect;
+    char *png;
+    int png_len;
+    char *error;
+    double time;
+    uv_work_t req;
+};
+
+struct region_batch {
+    Persistent<Function> callback;
+    Persistent<Value> buffer;
+    unsigned char *data;
+    int stride;
+    buffer_type buf_type;
+    encode_options opts;
+    std::vector<region_job> jobs;
+    int pending;
+};
+
+void
+Png::UV_RegionEncode(uv_work_t *req)
+{
+    region_job *job = (region_job *)req->data;
+    region_batch *batch = job->batch;
+    Rect &r = job->rect;
+
+    uint64_t start = uv_hrtime();
+    try {
+        unsigned char *data = batch->data + (long)r.y*batch->stride +
+            (long)r.x*bytes_per_pixel(batch->buf_type, 8);
+        PngEncoder encoder(data, r.w, r.h, batch->buf_type, 8);
+        encoder.set_stride(batch->stride);
+        encoder.set_options(batch->opts);
+        encoder.encode();
+        job->png_len = encoder.get_png_len();
+        job->png = encoder.release_png();
+    }
+    catch (const char *err) {
+        job->error = strdup(err);
+    }
+    job->time = (uv_hrtime() - start)/1e6;
+}
+
+void
+Png::UV_RegionEncodeAfter(uv_work_t *req)
+{
+    HandleScope scope;
+
+    region_job *job = (region_job *)req->data;
+    region_batch *batch = job->batch;
+    if (--batch->pending > 0)
+        return;
+
+    Handle<Value> argv[2];
+    argv[0] = Undefined();
+    argv[1] = Undefined();
+
+    for (size_t i = 0; i < batch->jobs.size(); i++) {
+        if (batch->jobs[i].error) {
+            argv[1] = ErrorException(batch->jobs[i].error);
+            break;
+        }
+    }
+
+    if (argv[1]->IsUndefined()) {
+        Local<Array> results = Array::New(batch->jobs.size());
+        for (size_t i = 0; i < batch->jobs.size(); i++) {
+            region_job &j = batch->jobs[i];
+            Buffer *buf = Buffer::New(j.png_len);
+            memcpy(BufferData(buf), j.png, j.png_len);
+
+            Local<Object> result = Object::New();
+            result->Set(String::NewSymbol("x"), Integer::New(j.rect.x));
+            result->Set(String::NewSymbol("y"), Integer::New(j.rect.y));
+            result->Set(String::NewSymbol("w"), Integer::New(j.rect.w));
+            result->Set(String::NewSymbol("h"), Integer::New(j.rect.h));
+            result->Set(String::NewSymbol("png"), buf->handle_);
+            result->Set(String::NewSymbol("time"), Number::New(j.time));
+            results->Set(i, result);
+        }
+        argv[0] = results;
+    }
+
+    TryCatch try_catch;
+
+    batch->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    batch->callback.Dispose();
+    batch->buffer.Dispose();
+    unref_encode_options(batch->opts);
+    for (size_t i = 0; i < batch->jobs.size(); i++) {
+        BufferPool::release(batch->jobs[i].png);
+        free(batch->jobs[i].error);
+    }
+    delete batch;
+    BufferPool::report_external();
+}
+
+Handle<Value>
+Png::EncodeRegions(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 6 || args.Length() > 7)
+        return VException("Six or seven arguments required - data buffer, width, height, input buffer type, regions, [encode options and] callback function.");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer width.");
+    if (!args[2]->IsInt32())
+        return VException("Third argument must be integer height.");
+    if (!args[4]->IsArray())
+        return VException("Fifth argument must be an array of regions.");
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
+
+    buffer_type buf_type;
+    if (!args[3]->IsString() || !parse_buffer_type(*String::AsciiValue(args[3]), buf_type))
+        return VException("Fourth argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+
+    int w = args[1]->Int32Value();
+    int h = args[2]->Int32Value();
+    if (w < 0)
+        return VException("Width smaller than 0.");
+    if (h < 0)
+        return VException("Height smaller than 0.");
+
+    int stride = row_length(w, bytes_per_pixel(buf_type, 8));
+    if (stride < 0)
+        return VException("Width too large.");
+    Local<Object> buf_obj = args[0]->ToObject();
+    if (!rows_fit(BufferLength(buf_obj), h, stride, stride))
+        return VException("Buffer too small for given width and height.");
+
+    Local<Array> regions = Local<Array>::Cast(args[4]);
+    if (regions->Length() == 0)
+        return VException("At least one region required.");
+
+    std::vector<Rect> rects(regions->Length());
+    for (size_t i = 0; i < rects.size(); i++) {
+        const char *err = parse_rect(regions->Get(i), w, h, rects[i]);
+        if (err) return VException(err);
+    }
+
+    encode_options opts;
+    if (args.Length() == 7) {
+        const char *err = parse_encode_options(args[5], opts);
+        if (err) return VException(err);
+        // The regions are encoded in parallel and in no particular order,
+        // a session would get them mixed up.
+        if (opts.session || opts.band_rows)
+            return VException("Options session and bandRows can't be used with encodeRegions.");
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+
+    region_batch *batch = new region_batch;
+    batch->callback = Persistent<Function>::New(callback);
+    batch->buffer = Persistent<Value>::New(args[0]);
+    batch->data = (unsigned char *)BufferData(buf_obj);
+    batch->stride = stride;
+    batch->buf_type = buf_type;
+    batch->opts = opts;
+    batch->pending = rects.size();
+    ref_encode_options(opts);
+
+    // Sized up front, the thread pool holds pointers into it.
+    batch->jobs.resize(rects.size());
+    for (size_t i = 0; i < rects.size(); i++) {
+        region_job &job = batch->jobs[i];
+        job.batch = batch;
+        job.rect = rects[i];
+        job.png = NULL;
+        job.png_len = 0;
+        job.error = NULL;
+        job.time = 0;
+        job.req.data = &job;
+    }
+    for (size_t i = 0; i < rects.size(); i++) {
+        uv_queue_work(uv_default_loop(), &batch->jobs[i].req, UV_RegionEncode,
+            (uv_after_work_cb)UV_RegionEncodeAfter);
+    }
+
+    return Undefined();
+}
+
+struct file_request {
+    Persistent<Function> callback;
+    Png *png;
+    char *buf_data;
+    std::string path;
+    encode_options opts;
+    bool sync;
+    encode_info info;
+    double bytes, time, fsync_time;
+    char *error;
+};
+
+void
+Png::UV_EncodeToFile(uv_work_t *req)
+{
+    file_request *file_req = (file_request *)req->data;
+    Png *png = file_req->png;
+
+    uint64_t start = uv_hrtime();
+    FileSink sink(file_req->path.c_str(), 256*1024);
+    try {
+        sink.open();
+        PngEncoder encoder((unsigned char *)file_req->buf_data + png->offset, png->width,
+            png->height, png->buf_type, png->bits);
+        encoder.set_stride(png->stride);
+        encoder.set_options(file_req->opts);
+        encoder.set_sink(&sink);
+        encoder.encode();
+        file_req->info = encoder.get_info();
+        if (file_req->sync)
+            file_req->fsync_time = sink.sync();
+        sink.close();
+        file_req->bytes = sink.get_bytes();
+    }
+    catch (const char *err) {
+        file_req->error = strdup(err);
+        sink.remove();
+    }
+    file_req->time = (uv_hrtime() - start)/1e6;
+}
+
+void
+Png::UV_EncodeToFileAfter(uv_work_t *req)
+{
+    HandleScope scope;
+
+    file_request *file_req = (file_request *)req->data;
+    delete req;
+
+    Handle<Value> argv[2];
+
+    if (file_req->error) {
+        argv[0] = Undefined();
+        argv[1] = ErrorException(file_req->error);
+    }
+    else {
+        file_req->png->info = file_req->info;
+        Local<Object> result = Object::New();
+        result->Set(String::NewSymbol("bytes"), Number::New(file_req->bytes));
+        result->Set(String::NewSymbol("time"), Number::New(file_req->time));
+        result->Set(String::NewSymbol("fsyncTime"), Number::New(file_req->fsync_time));
+        argv[0] = result;
+        argv[1] = Undefined();
+    }
+
+    TryCatch try_catch;
+
+    file_req->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    file_req->callback.Dispose();
+    unref_encode_options(file_req->opts);
+    free(file_req->error);
+    file_req->png->Unref();
+    delete file_req;
+    BufferPool::report_external();
+}
+
+// png.encodeToFile(path, [opts,] callback) encodes in the thread pool and
+// writes the PNG to path as it's produced. With fsync (the default) the file
+// is synced before the callback.
+Handle<Value>
+Png::EncodeToFile(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2 || args.Length() > 3)
+        return VException("Two or three arguments required - path, [encode options and] callback function.");
+    if (!args[0]->IsString())
+        return VException("First argument must be a path.");
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
+
+    encode_options opts;
+    bool sync = true;
+    if (args.Length() == 3) {
+        const char *err = parse_encode_options(args[1], opts);
+        if (err) return VException(err);
+
+        if (args[1]->IsObject()) {
+            Local<Value> fsync = args[1]->ToObject()->Get(String::NewSymbol("fsync"));
+            if (!fsync->IsUndefined()) {
+                if (!fsync->IsBoolean())
+                    return VException("Option 'fsync' must be true or false.");
+                sync = fsync->BooleanValue();
+            }
+        }
+    }
+
+    // The file is written as the PNG is encoded, which the cache would
+    // have to hold up.
+    opts.cache = NULL;
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+
+    file_request *file_req = new file_request;
+    file_req->callback = Persistent<Function>::New(callback);
+    file_req->png = png;
+    file_req->path = *String::Utf8Value(args[0]);
+    file_req->opts = opts;
+    file_req->sync = sync;
+    file_req->bytes = 0;
+    file_req->time = 0;
+    file_req->fsync_time = 0;
+    file_req->error = NULL;
+    ref_encode_options(opts);
+
+    Local<Value> buf_val = png->handle_->GetHiddenValue(String::New("buffer"));
+    file_req->buf_data = BufferData(buf_val->ToObject());
+
+    uv_work_t *req = new uv_work_t;
+    req->data = file_req;
+    uv_queue_work(uv_default_loop(), req, UV_EncodeToFile, (uv_after_work_cb)UV_EncodeToFileAfter);
+    png->Ref();
+
+    return Undefined();
+}
+
+// The error for a target Buffer that's too small, with the size it needs in
+// its required property.
+static Handle<Value>
+too_small_error(size_t required)
+{
+    HandleScope scope;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Target buffer too small, the PNG needs %lu bytes.",
+        (unsigned long)required);
+    Local<Object> err = ErrorException(msg)->ToObject();
+    err->Set(String::NewSymbol("required"), Number::New(required));
+    return scope.Close(err);
+}
+
+// png.encodeIntoSync(target, [opts]) encodes into the target Buffer and
+// returns the number of bytes used.
+Handle<Value>
+Png::EncodeIntoSync(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0]))
+        return VException("First argument must be the target Buffer.");
+
+    encode_options opts;
+    if (args.Length() >= 2) {
+        const char *err = parse_encode_options(args[1], opts);
+        if (err) return VException(err);
+    }
+
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+    Local<Value> buf_val = png->handle_->GetHiddenValue(String::New("buffer"));
+    char *buf_data = BufferData(buf_val->ToObject());
+    Local<Object> target = args[0]->ToObject();
+
+    try {
+        MemorySink sink(BufferData(target), BufferLength(target));
+        PngEncoder encoder((unsigned char *)buf_data + png->offset, png->width, png->height,
+            png->buf_type, png->bits);
+        encoder.set_stride(png->stride);
+        encoder.set_options(opts);
+        encoder.set_sink(&sink);
+        encoder.encode();
+        if (!sink.fits())
+            return ThrowException(too_small_error(sink.length()));
+        png->info = encoder.get_info();
+        BufferPool::report_external();
+        return scope.Close(Number::New(sink.length()));
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+}
+
+struct into_request {
+    Persistent<Function> callback;
+    Persistent<Value> target;
+    Png *png;
+    char *buf_data;
+    char *dst;
+    size_t capacity, len;
+    bool fits;
+    encode_options opts;
+    encode_info info;
+    char *error;
+};
+
+void
+Png::UV_EncodeInto(uv_work_t *req)
+{
+    into_request *into_req = (into_request *)req->data;
+    Png *png = into_req->png;
+
+    try {
+        MemorySink sink(into_req->dst, into_req->capacity);
+        PngEncoder encoder((unsigned char *)into_req->buf_data + png->offset, png->width,
+            png->height, png->buf_type, png->bits);
+        encoder.set_stride(png->stride);
+        encoder.set_options(into_req->opts);
+        encoder.set_sink(&sink);
+        encoder.encode();
+        into_req->info = encoder.get_info();
+        into_req->len = sink.length();
+        into_req->fits = sink.fits();
+    }
+    catch (const char *err) {
+        into_req->error = strdup(err);
+    }
+}
+
+void
+Png::UV_EncodeIntoAfter(uv_work_t *req)
+{
+    HandleScope scope;
+
+    into_request *into_req = (into_request *)req->data;
+    delete req;
+
+    Handle<Value> argv[2];
+
+    if (into_req->error) {
+        argv[0] = Undefined();
+        argv[1] = ErrorException(into_req->error);
+    }
+    else if (!into_req->fits) {
+        argv[0] = Undefined();
+        argv[1] = too_small_error(into_req->len);
+    }
+    else {
+        into_req->png->info = into_req->info;
+        argv[0] = Number::New(into_req->len);
+        argv[1] = Undefined();
+    }
+
+    TryCatch try_catch;
+
+    into_req->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    into_req->callback.Dispose();
+    into_req->target.Dispose();
+    unref_encode_options(into_req->opts);
+    free(into_req->error);
+    into_req->png->Unref();
+    delete into_req;
+    BufferPool::report_external();
+}
+
+// png.encodeInto(target, [opts,] callback) is the asynchronous encodeIntoSync.
+// The callback gets the number of bytes used. The target mustn't be touched
+// until then.
+Handle<Value>
+Png::EncodeInto(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2 || args.Length() > 3)
+        return VException("Two or three arguments required - target Buffer, [encode options and] callback function.");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be the target Buffer.");
+    if (!args[args.Length()-1]->IsFunction())
+        return VException("Last argument must be a function.");
+
+    encode_options opts;
+    if (args.Length() == 3) {
+        const char *err = parse_encode_options(args[1], opts);
+        if (err) return VException(err);
+    }
+
+    Local<Function> callback = Local<Function>::Cast(args[args.Length()-1]);
+    Png *png = ObjectWrap::Unwrap<Png>(args.This());
+    Local<Object> target = args[0]->ToObject();
+
+    into_request *into_req = new into_request;
+    into_req->callback = Persistent<Function>::New(callback);
+    into_req->target = Persistent<Value>::New(args[0]);
+    into_req->png = png;
+    into_req->dst = BufferData(target);
+    into_req->capacity = BufferLength(target);
+    into_req->len = 0;
+    into_req->fits = false;
+    into_req->opts = opts;
+    into_req->error = NULL;
+    ref_encode_options(opts);
+
+    Local<Value> buf_val = png->handle_->GetHiddenValue(String::New("buffer"));
+    into_req->buf_data = BufferData(buf_val->ToObject());
+
+    uv_work_t *req = new uv_work_t;
+    req->data = into_req;
+    uv_queue_work(uv_default_loop(), req, UV_EncodeInto, (uv_after_work_cb)UV_EncodeIntoAfter);
+    png->Ref();
+
+    return Undefined();
+}
+
+// Png.probe(png_buffer, [{ crc: true }]) tells what a PNG is from its chunk
+// list, without decoding it. CRCs are only checked with crc set.
+Handle<Value>
+Png::Probe(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0]))
+        return VException("First argument must be a Buffer with the PNG.");
+
+    bool check_crc = false;
+    if (args.Length() >= 2 && !args[1]->IsUndefined()) {
+        if (!args[1]->IsObject())
+            return VException("Second argument must be an options object.");
+        check_crc = args[1]->ToObject()->Get(String::NewSymbol("crc"))->BooleanValue();
+    }
+
+    Local<Object> buf_obj = args[0]->ToObject();
+    png_probe probe;
+    try {
+        probe_png((const unsigned char *)BufferData(buf_obj), BufferLength(buf_obj), check_crc,
+            probe);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("width"), Integer::New(probe.width));
+    obj->Set(String::NewSymbol("height"), Integer::New(probe.height));
+    obj->Set(String::NewSymbol("bitDepth"), Integer::New(probe.bit_depth));
+    obj->Set(String::NewSymbol("colorType"), String::New(probe.color_type));
+    obj->Set(String::NewSymbol("interlaced"), Boolean::New(probe.interlaced));
+    obj->Set(String::NewSymbol("idatBytes"), Number::New(probe.idat_bytes));
+    obj->Set(String::NewSymbol("animated"), Boolean::New(probe.animated));
+    if (probe.animated)
+        obj->Set(String::NewSymbol("frames"), Integer::New(probe.frames));
+    obj->Set(String::NewSymbol("complete"), Boolean::New(probe.complete));
+    Local<Array> chunks = Array::New(probe.chunks.size());
+    for (size_t i = 0; i < probe.chunks.size(); i++)
+        chunks->Set(i, String::New(probe.chunks[i].c_str()));
+    obj->Set(String::NewSymbol("chunks"), chunks);
+    return scope.Close(obj);
+}
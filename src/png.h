@@ -7,21 +7,40 @@
 #include "common.h"
 
 class Png : public node::ObjectWrap {
+    friend class PngReadStream;
+
     int width;
     int height;
     buffer_type buf_type;
     int bits;
+    int stride;
+    long offset;
+    encode_info info;
 
     static void UV_PngEncode(uv_work_t *req);
     static void UV_PngEncodeAfter(uv_work_t *req);
+    static void UV_RegionEncode(uv_work_t *req);
+    static void UV_RegionEncodeAfter(uv_work_t *req);
+    static void UV_EncodeToFile(uv_work_t *req);
+    static void UV_EncodeToFileAfter(uv_work_t *req);
+    static void UV_EncodeInto(uv_work_t *req);
+    static void UV_EncodeIntoAfter(uv_work_t *req);
 public:
     static void Initialize(v8::Handle<v8::Object> target);
-    Png(int wwidth, int hheight, buffer_type bbuf_type, int bbits);
-    v8::Handle<v8::Value> PngEncodeSync();
+    Png(int wwidth, int hheight, buffer_type bbuf_type, int bbits, int sstride, long ooffset);
+    v8::Handle<v8::Value> PngEncodeSync(const encode_options &opts);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> PngEncodeSync(const v8::Arguments &args);
     static v8::Handle<v8::Value> PngEncodeAsync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Estimate(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeInto(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeIntoSync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeToFile(const v8::Arguments &args);
+    static v8::Handle<v8::Value> CreateReadStream(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeInfo(const v8::Arguments &args);
+    static v8::Handle<v8::Value> EncodeRegions(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Probe(const v8::Arguments &args);
 };
 
 #endif
@@ -0,0 +1,168 @@
+#include <cstdlib>
+
+#include "png_cache.h"
+#include "buffer_pool.h"
+
+using namespace v8;
+using namespace node;
+
+Persistent<FunctionTemplate> PngCache::constructor_template;
+
+void
+PngCache::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "stats", Stats);
+    NODE_SET_PROTOTYPE_METHOD(t, "clear", Clear);
+    target->Set(String::NewSymbol("PngCache"), t->GetFunction());
+}
+
+bool
+PngCache::HasInstance(Handle<Value> val)
+{
+    if (!val->IsObject())
+        return false;
+    return constructor_template->HasInstance(val->ToObject());
+}
+
+PngCache::PngCache(size_t mmax_bytes) :
+    bytes(0), max_bytes(mmax_bytes), hits(0), misses(0), evictions(0)
+{
+    uv_mutex_init(&lock);
+}
+
+PngCache::~PngCache()
+{
+    uv_mutex_destroy(&lock);
+}
+
+// On a hit png gets a copy of the cached PNG from the BufferPool. Called from the
+// thread pool, hence the lock.
+bool
+PngCache::get(uint64_t key, char *&png, unsigned int &png_len, encode_info &info)
+{
+    uv_mutex_lock(&lock);
+    mEntry::iterator it = index.find(key);
+    if (it == index.end()) {
+        misses++;
+        uv_mutex_unlock(&lock);
+        return false;
+    }
+
+    Entry &e = *it->second;
+    try {
+        png = (char *)BufferPool::allocate(e.png.size());
+    }
+    catch (const char *err) {
+        uv_mutex_unlock(&lock);
+        throw;
+    }
+    memcpy(png, &e.png[0], e.png.size());
+    png_len = e.png.size();
+    info = e.info;
+    entries.splice(entries.begin(), entries, it->second);
+    hits++;
+    uv_mutex_unlock(&lock);
+    return true;
+}
+
+// Like get, for callers that only need to know whether the key is there.
+bool
+PngCache::touch(uint64_t key)
+{
+    uv_mutex_lock(&lock);
+    mEntry::iterator it = index.find(key);
+    bool found = it != index.end();
+    if (found) {
+        entries.splice(entries.begin(), entries, it->second);
+        hits++;
+    }
+    else {
+        misses++;
+    }
+    uv_mutex_unlock(&lock);
+    return found;
+}
+
+void
+PngCache::put(uint64_t key, const char *png, unsigned int png_len, const encode_info &info)
+{
+    if (png_len > max_bytes)
+        return;
+
+    uv_mutex_lock(&lock);
+    // Two encodes of the same input may race, the first one wins.
+    if (index.find(key) == index.end()) {
+        while (bytes + png_len > max_bytes) {
+            Entry &last = entries.back();
+            bytes -= last.png.size();
+            index.erase(last.key);
+            entries.pop_back();
+            evictions++;
+        }
+
+        entries.push_front(Entry());
+        Entry &e = entries.front();
+        e.key = key;
+        e.png.assign(png, png + png_len);
+        e.info = info;
+        index[key] = entries.begin();
+        bytes += png_len;
+    }
+    uv_mutex_unlock(&lock);
+}
+
+void
+PngCache::clear()
+{
+    uv_mutex_lock(&lock);
+    entries.clear();
+    index.clear();
+    bytes = 0;
+    uv_mutex_unlock(&lock);
+}
+
+Handle<Value>
+PngCache::New(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->NumberValue() < 0)
+        return VException("One argument required - maximum number of bytes to cache.");
+
+    PngCache *cache = new PngCache((size_t)args[0]->NumberValue());
+    cache->Wrap(args.This());
+    return args.This();
+}
+
+Handle<Value>
+PngCache::Stats(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngCache *cache = ObjectWrap::Unwrap<PngCache>(args.This());
+    Local<Object> stats = Object::New();
+    uv_mutex_lock(&cache->lock);
+    stats->Set(String::NewSymbol("hits"), Number::New(cache->hits));
+    stats->Set(String::NewSymbol("misses"), Number::New(cache->misses));
+    stats->Set(String::NewSymbol("evictions"), Number::New(cache->evictions));
+    stats->Set(String::NewSymbol("entries"), Number::New(cache->entries.size()));
+    stats->Set(String::NewSymbol("bytes"), Number::New(cache->bytes));
+    stats->Set(String::NewSymbol("maxBytes"), Number::New(cache->max_bytes));
+    uv_mutex_unlock(&cache->lock);
+    return scope.Close(stats);
+}
+
+Handle<Value>
+PngCache::Clear(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngCache *cache = ObjectWrap::Unwrap<PngCache>(args.This());
+    cache->clear();
+    return Undefined();
+}
@@ -0,0 +1,55 @@
+#ifndef PNG_CACHE_H
+#define PNG_CACHE_H
+
+#include <node.h>
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include <stdint.h>
+
+#include "common.h"
+
+// LRU cache of encoded PNGs keyed by a hash of the input pixels, dimensions,
+// buffer type and encode options. Bounded by the bytes of PNG data it holds.
+// Passed to encode() and encodeSync() with the cache option and shared by
+// the encodes running in the thread pool.
+class PngCache : public node::ObjectWrap {
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
+    struct Entry {
+        uint64_t key;
+        std::vector<char> png;
+        encode_info info;
+    };
+
+    typedef std::list<Entry> lEntry;
+    typedef std::map<uint64_t, lEntry::iterator> mEntry;
+
+    uv_mutex_t lock;
+    lEntry entries;     // most recently used first
+    mEntry index;
+    size_t bytes, max_bytes;
+    double hits, misses, evictions;
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    static bool HasInstance(v8::Handle<v8::Value> val);
+    PngCache(size_t mmax_bytes);
+    ~PngCache();
+
+    using node::ObjectWrap::Ref;
+    using node::ObjectWrap::Unref;
+
+    bool get(uint64_t key, char *&png, unsigned int &png_len, encode_info &info);
+    bool touch(uint64_t key);
+    void put(uint64_t key, const char *png, unsigned int png_len, const encode_info &info);
+    void clear();
+
+    static v8::Handle<v8::Value> New(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Stats(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Clear(const v8::Arguments &args);
+};
+
+#endif
@@ -0,0 +1,351 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "png_decoder.h"
+#include "buffer_pool.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+Persistent<FunctionTemplate> PngDecoder::constructor_template;
+
+void
+PngDecoder::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "decode", Decode);
+    NODE_SET_PROTOTYPE_METHOD(t, "decodeSync", DecodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", End);
+    target->Set(String::NewSymbol("PngDecoder"), t->GetFunction());
+}
+
+PngDecoder::PngDecoder(buffer_type oout_type) :
+    out_type(oout_type), reader(NULL), decoding(false), delivering(false), ending(false),
+    header_sent(false), rows_sent(0), error(NULL) {}
+
+PngDecoder::~PngDecoder()
+{
+    delete reader;
+    free(error);
+}
+
+static Handle<Object>
+header_object(const decode_info &info)
+{
+    HandleScope scope;
+
+    Local<Object> obj = Object::New();
+    obj->Set(String::NewSymbol("width"), Integer::New(info.width));
+    obj->Set(String::NewSymbol("height"), Integer::New(info.height));
+    obj->Set(String::NewSymbol("colorType"), String::New(info.color_type));
+    obj->Set(String::NewSymbol("bitDepth"), Integer::New(info.bit_depth));
+    obj->Set(String::NewSymbol("interlaced"), Boolean::New(info.interlaced));
+    obj->Set(String::NewSymbol("rowBytes"), Integer::New(info.row_bytes));
+    return scope.Close(obj);
+}
+
+// The header plus the pixels in data.
+static Handle<Object>
+image_object(const PngReader &reader)
+{
+    HandleScope scope;
+
+    Local<Object> obj = Local<Object>::New(header_object(reader.get_info()));
+    Buffer *buf = Buffer::New(reader.get_pixels_len());
+    memcpy(BufferData(buf), reader.get_pixels(), reader.get_pixels_len());
+    obj->Set(String::NewSymbol("data"), buf->handle_);
+    return scope.Close(obj);
+}
+
+// decoder.decodeSync(png_buffer) returns the image, see image_object.
+Handle<Value>
+PngDecoder::DecodeSync(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0]))
+        return VException("First argument must be a Buffer with the PNG.");
+
+    PngDecoder *decoder = ObjectWrap::Unwrap<PngDecoder>(args.This());
+    Local<Object> buf_obj = args[0]->ToObject();
+
+    // The reader outlives the try, its errors point into it.
+    PngReader reader(decoder->out_type);
+    try {
+        reader.decode((const unsigned char *)BufferData(buf_obj), BufferLength(buf_obj));
+        Handle<Object> image = image_object(reader);
+        BufferPool::report_external();
+        return scope.Close(image);
+    }
+    catch (const char *err) {
+        return VException(err);
+    }
+}
+
+struct decode_request {
+    Persistent<Function> callback;
+    Persistent<Value> source;
+    PngDecoder *decoder;
+    const unsigned char *data;
+    size_t len;
+    PngReader *reader;
+    char *error;
+};
+
+void
+PngDecoder::UV_Decode(uv_work_t *req)
+{
+    decode_request *dec_req = (decode_request *)req->data;
+
+    try {
+        dec_req->reader->decode(dec_req->data, dec_req->len);
+    }
+    catch (const char *err) {
+        dec_req->error = strdup(err);
+    }
+}
+
+void
+PngDecoder::UV_DecodeAfter(uv_work_t *req)
+{
+    HandleScope scope;
+
+    decode_request *dec_req = (decode_request *)req->data;
+    delete req;
+
+    Handle<Value> argv[2];
+
+    if (dec_req->error) {
+        argv[0] = Undefined();
+        argv[1] = ErrorException(dec_req->error);
+    }
+    else {
+        argv[0] = image_object(*dec_req->reader);
+        argv[1] = Undefined();
+    }
+    delete dec_req->reader;
+
+    TryCatch try_catch;
+
+    dec_req->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    dec_req->callback.Dispose();
+    dec_req->source.Dispose();
+    free(dec_req->error);
+    dec_req->decoder->Unref();
+    delete dec_req;
+    BufferPool::report_external();
+}
+
+// decoder.decode(png_buffer, callback) is the asynchronous decodeSync. The
+// callback gets (image, error).
+Handle<Value>
+PngDecoder::Decode(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 2)
+        return VException("Two arguments required - Buffer with the PNG and callback function.");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be a Buffer with the PNG.");
+    if (!args[1]->IsFunction())
+        return VException("Second argument must be a function.");
+
+    Local<Function> callback = Local<Function>::Cast(args[1]);
+    PngDecoder *decoder = ObjectWrap::Unwrap<PngDecoder>(args.This());
+    Local<Object> buf_obj = args[0]->ToObject();
+
+    decode_request *dec_req = new decode_request;
+    dec_req->callback = Persistent<Function>::New(callback);
+    dec_req->source = Persistent<Value>::New(args[0]);
+    dec_req->decoder = decoder;
+    dec_req->data = (const unsigned char *)BufferData(buf_obj);
+    dec_req->len = BufferLength(buf_obj);
+    dec_req->reader = new PngReader(decoder->out_type);
+    dec_req->error = NULL;
+
+    uv_work_t *req = new uv_work_t;
+    req->data = dec_req;
+    uv_queue_work(uv_default_loop(), req, UV_Decode, (uv_after_work_cb)UV_DecodeAfter);
+    decoder->Ref();
+
+    return Undefined();
+}
+
+// Hands everything pushed so far to a worker.
+void
+PngDecoder::start_push()
+{
+    if (!reader)
+        reader = new PngReader(out_type);
+    working.swap(pending);
+    decoding = true;
+
+    uv_work_t *req = new uv_work_t;
+    req->data = this;
+    uv_queue_work(uv_default_loop(), req, UV_Push, (uv_after_work_cb)UV_PushAfter);
+    Ref();
+}
+
+void
+PngDecoder::UV_Push(uv_work_t *req)
+{
+    PngDecoder *decoder = (PngDecoder *)req->data;
+
+    try {
+        decoder->reader->push(&decoder->working[0], decoder->working.size());
+    }
+    catch (const char *err) {
+        decoder->error = strdup(err);
+    }
+    decoder->working.clear();
+}
+
+void
+PngDecoder::UV_PushAfter(uv_work_t *req)
+{
+    PngDecoder *decoder = (PngDecoder *)req->data;
+    delete req;
+    decoder->decoding = false;
+    decoder->deliver();
+    decoder->Unref();
+    BufferPool::report_external();
+}
+
+// Ready for the next PNG.
+void
+PngDecoder::reset()
+{
+    delete reader;
+    reader = NULL;
+    pending.clear();
+    ending = header_sent = false;
+    rows_sent = 0;
+    free(error);
+    error = NULL;
+}
+
+// Runs on the loop thread when no worker is busy. Calls onheader once the
+// header is read, onrows with the rows decoded since the last call, then
+// onend or onerror. Handlers may push() or end() from here.
+void
+PngDecoder::deliver()
+{
+    if (delivering)
+        return;
+
+    HandleScope scope;
+    delivering = true;
+
+    if (error) {
+        Handle<Value> argv[1] = { ErrorException(error) };
+        reset();
+        delivering = false;
+        call_handler(handle_, "onerror", 1, argv);
+        return;
+    }
+
+    if (reader && reader->header_read() && !header_sent) {
+        header_sent = true;
+        Handle<Value> argv[1] = { header_object(reader->get_info()) };
+        call_handler(handle_, "onheader", 1, argv);
+    }
+
+    if (reader && reader->get_rows_done() > rows_sent) {
+        int row_bytes = reader->get_info().row_bytes;
+        int count = reader->get_rows_done() - rows_sent;
+        Buffer *buf = Buffer::New((size_t)count*row_bytes);
+        memcpy(BufferData(buf), reader->get_pixels() + (size_t)rows_sent*row_bytes,
+            (size_t)count*row_bytes);
+        Handle<Value> argv[3] = { buf->handle_, Integer::New(rows_sent), Integer::New(count) };
+        rows_sent += count;
+        call_handler(handle_, "onrows", 3, argv);
+    }
+
+    if (reader && reader->is_finished()) {
+        // Anything pushed after the end of the PNG is dropped.
+        Handle<Value> argv[1] = { image_object(*reader) };
+        reset();
+        delivering = false;
+        call_handler(handle_, "onend", 1, argv);
+        return;
+    }
+
+    delivering = false;
+    if (decoding)
+        return;
+    if (!pending.empty()) {
+        start_push();
+    }
+    else if (ending) {
+        bool started = reader != NULL;
+        reset();
+        if (started) {
+            Handle<Value> argv[1] = { ErrorException("PNG data ends early.") };
+            call_handler(handle_, "onerror", 1, argv);
+        }
+    }
+}
+
+Handle<Value>
+PngDecoder::New(const Arguments &args)
+{
+    HandleScope scope;
+
+    buffer_type out_type = BUF_RGBA;
+    if (args.Length() >= 1 && !args[0]->IsUndefined()) {
+        if (!args[0]->IsString() || !parse_buffer_type(*String::AsciiValue(args[0]), out_type))
+            return VException("First argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+    }
+
+    PngDecoder *decoder = new PngDecoder(out_type);
+    decoder->Wrap(args.This());
+    return args.This();
+}
+
+// decoder.push(buffer) adds the next piece of the PNG. The data is copied,
+// the Buffer can be reused right away.
+Handle<Value>
+PngDecoder::Push(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1 || !Buffer::HasInstance(args[0]))
+        return VException("One argument required - Buffer with PNG data.");
+
+    PngDecoder *decoder = ObjectWrap::Unwrap<PngDecoder>(args.This());
+    if (decoder->ending)
+        return VException("Can't push after end().");
+
+    Local<Object> buf_obj = args[0]->ToObject();
+    const char *data = BufferData(buf_obj);
+    decoder->pending.insert(decoder->pending.end(), data, data + BufferLength(buf_obj));
+    if (!decoder->decoding && !decoder->delivering && !decoder->pending.empty())
+        decoder->start_push();
+
+    return Undefined();
+}
+
+// decoder.end() tells there's no more data. If the PNG isn't complete by then
+// onerror gets called.
+Handle<Value>
+PngDecoder::End(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngDecoder *decoder = ObjectWrap::Unwrap<PngDecoder>(args.This());
+    decoder->ending = true;
+    if (!decoder->decoding && !decoder->delivering)
+        decoder->deliver();
+
+    return Undefined();
+}
@@ -0,0 +1,49 @@
+#ifndef PNG_DECODER_H
+#define PNG_DECODER_H
+
+#include <node.h>
+
+#include <vector>
+
+#include "common.h"
+#include "png_reader.h"
+
+// Decodes PNGs into buffers of the type given to the constructor, either in
+// one go with decode() and decodeSync() or progressively: push() the data as
+// it arrives and the rows come out through onrows as soon as they're
+// decoded. Decoding runs in the thread pool, except decodeSync.
+class PngDecoder : public node::ObjectWrap {
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
+    buffer_type out_type;
+
+    // The PNG being pushed. The reader and working are the worker's while
+    // decoding is set, pending collects what's pushed in the meantime.
+    PngReader *reader;
+    std::vector<unsigned char> pending, working;
+    bool decoding, delivering, ending, header_sent;
+    int rows_sent;
+    char *error;
+
+    void start_push();
+    void deliver();
+    void reset();
+
+    static void UV_Decode(uv_work_t *req);
+    static void UV_DecodeAfter(uv_work_t *req);
+    static void UV_Push(uv_work_t *req);
+    static void UV_PushAfter(uv_work_t *req);
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    PngDecoder(buffer_type oout_type);
+    ~PngDecoder();
+
+    static v8::Handle<v8::Value> New(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Decode(const v8::Arguments &args);
+    static v8::Handle<v8::Value> DecodeSync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Push(const v8::Arguments &args);
+    static v8::Handle<v8::Value> End(const v8::Arguments &args);
+};
+
+#endif
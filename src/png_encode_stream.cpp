@@ -0,0 +1,383 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "png_encode_stream.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+Persistent<FunctionTemplate> PngEncodeStream::constructor_template;
+
+// Not exported, streams only come from Png.createEncodeStream().
+void
+PngEncodeStream::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "write", Write);
+    NODE_SET_PROTOTYPE_METHOD(t, "end", End);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", Destroy);
+}
+
+PngEncodeStream::PngEncodeStream() :
+    width(0), height(0), bits(8), buf_type(BUF_RGB), chunk_size(0), high_water(0),
+    expected(0), written(0), input_offset(0), queued(0), input_ended(false),
+    destroyed(false), encoded(false), need_drain(false), drain(false), waiting(false),
+    idle(false), ended(false), error(NULL)
+{
+    uv_mutex_init(&lock);
+    uv_cond_init(&cond);
+}
+
+PngEncodeStream::~PngEncodeStream()
+{
+    uv_cond_destroy(&cond);
+    uv_mutex_destroy(&lock);
+    free(error);
+}
+
+// PngRowSource, called by the encoder on the encoding thread. Waits until a
+// whole row has been written, telling the loop thread when it starts to.
+const unsigned char *
+PngEncodeStream::next_row()
+{
+    size_t got = 0;
+
+    uv_mutex_lock(&lock);
+    while (got < row.size()) {
+        while (input.empty() && !input_ended && !destroyed) {
+            if (!waiting) {
+                waiting = true;
+                uv_async_send(&async);
+            }
+            uv_cond_wait(&cond, &lock);
+        }
+        waiting = false;
+        if (destroyed) {
+            uv_mutex_unlock(&lock);
+            throw "Stream destroyed.";
+        }
+        if (input.empty()) {
+            uv_mutex_unlock(&lock);
+            throw "Stream ended before all rows were written.";
+        }
+
+        std::vector<char> &chunk = input.front();
+        size_t n = std::min(row.size() - got, chunk.size() - input_offset);
+        memcpy(&row[got], &chunk[input_offset], n);
+        got += n;
+        input_offset += n;
+        queued -= n;
+        if (input_offset == chunk.size()) {
+            input.pop_front();
+            input_offset = 0;
+        }
+    }
+    bool wake = need_drain && queued < high_water;
+    if (wake) {
+        need_drain = false;
+        drain = true;
+    }
+    uv_mutex_unlock(&lock);
+
+    if (wake)
+        uv_async_send(&async);
+    return &row[0];
+}
+
+// PngSink, called by the encoder on the encoding thread.
+void
+PngEncodeStream::write(const char *data, unsigned int len)
+{
+    pending.insert(pending.end(), data, data + len);
+    if (pending.size() >= chunk_size)
+        queue_output();
+}
+
+void
+PngEncodeStream::queue_output()
+{
+    uv_mutex_lock(&lock);
+    output.push_back(std::vector<char>());
+    output.back().swap(pending);
+    uv_mutex_unlock(&lock);
+
+    pending.reserve(chunk_size);
+    uv_async_send(&async);
+}
+
+void
+PngEncodeStream::UV_Encode(void *arg)
+{
+    PngEncodeStream *stream = (PngEncodeStream *)arg;
+
+    try {
+        PngEncoder encoder(NULL, stream->width, stream->height, stream->buf_type,
+            stream->bits);
+        encoder.set_options(stream->opts);
+        encoder.set_row_source(stream);
+        encoder.set_sink(stream);
+        encoder.encode();
+        stream->info = encoder.get_info();
+        if (!stream->pending.empty())
+            stream->queue_output();
+    }
+    catch (const char *err) {
+        stream->error = strdup(err);
+    }
+
+    uv_mutex_lock(&stream->lock);
+    stream->encoded = true;
+    uv_mutex_unlock(&stream->lock);
+    uv_async_send(&stream->async);
+}
+
+void
+PngEncodeStream::UV_Deliver(uv_async_t *handle)
+{
+    ((PngEncodeStream *)handle->data)->deliver();
+}
+
+void
+PngEncodeStream::UV_Close(uv_handle_t *handle)
+{
+    ((PngEncodeStream *)handle->data)->Unref();
+}
+
+// Runs on the loop thread. Hands the PNG chunks written so far to ondata,
+// calls ondrain if the input went below the high water mark, and onend or
+// onerror once the encoding thread is done.
+//
+// While the encoding thread waits for input nothing can happen until the
+// next write(), end() or destroy(), so the async handle is unref'd and a
+// stream that's been dropped half written doesn't keep the loop alive.
+void
+PngEncodeStream::deliver()
+{
+    if (ended)
+        return;
+
+    HandleScope scope;
+
+    lChunk chunks;
+    uv_mutex_lock(&lock);
+    chunks.swap(output);
+    bool drained = drain;
+    drain = false;
+    bool finished = encoded;
+    uv_mutex_unlock(&lock);
+
+    if (!destroyed) {
+        for (lChunk::iterator it = chunks.begin(); it != chunks.end(); ++it) {
+            Buffer *buf = Buffer::New(it->size());
+            memcpy(BufferData(buf), &(*it)[0], it->size());
+            Handle<Value> argv[1] = { buf->handle_ };
+            call_handler(handle_, "ondata", 1, argv);
+        }
+        if (drained && !finished)
+            call_handler(handle_, "ondrain", 0, NULL);
+    }
+
+    if (!finished) {
+        // The handlers may have written more.
+        uv_mutex_lock(&lock);
+        bool stalled = waiting && input.empty() && !input_ended && !destroyed;
+        uv_mutex_unlock(&lock);
+        if (stalled && !idle) {
+            uv_unref((uv_handle_t *)&async);
+            idle = true;
+        }
+        return;
+    }
+
+    ended = true;
+    uv_thread_join(&thread);
+    if (!destroyed) {
+        Handle<Value> argv[1];
+        if (error) {
+            argv[0] = ErrorException(error);
+            call_handler(handle_, "onerror", 1, argv);
+        }
+        else {
+            argv[0] = encode_info_object(info);
+            call_handler(handle_, "onend", 1, argv);
+        }
+    }
+
+    unref_encode_options(opts);
+    uv_close((uv_handle_t *)&async, UV_Close);
+}
+
+// Refs the async handle again once the encoding thread has something to do.
+void
+PngEncodeStream::wake()
+{
+    if (idle) {
+        uv_ref((uv_handle_t *)&async);
+        idle = false;
+    }
+}
+
+// Png.createEncodeStream(width, height, [type, bits, opts])
+Handle<Value>
+PngEncodeStream::Create(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2)
+        return VException("At least two arguments required - width, height, [input buffer type, bit width and encode options].");
+    if (!args[0]->IsInt32() || args[0]->Int32Value() < 1)
+        return VException("First argument must be positive integer width.");
+    if (!args[1]->IsInt32() || args[1]->Int32Value() < 1)
+        return VException("Second argument must be positive integer height.");
+
+    int arg = 2;
+    buffer_type buf_type = BUF_RGB;
+    if (args.Length() > arg && args[arg]->IsString()) {
+        if (!parse_buffer_type(*String::AsciiValue(args[arg]), buf_type))
+            return VException("Third argument must be 'gray', 'graya', 'rgb', 'bgr', 'rgba' or 'bgra'.");
+        arg++;
+    }
+
+    int bits = 8;
+    if (args.Length() > arg && args[arg]->IsInt32()) {
+        bits = args[arg]->Int32Value();
+        if (bits != 8 && bits != 16)
+            return VException("Bit width must be 8 or 16.");
+        arg++;
+    }
+
+    encode_options opts;
+    size_t chunk_size = 64*1024;
+    size_t high_water = 0;
+    if (args.Length() > arg) {
+        const char *err = parse_encode_options(args[arg], opts);
+        if (!err)
+            err = parse_stream_options(args[arg], chunk_size, high_water);
+        if (err) return VException(err);
+        if (opts.reduce || opts.palette || opts.quantize || opts.session || opts.band_rows)
+            return VException("Options reduce, palette, quantize, session and bandRows need the whole image, they can't be used with createEncodeStream.");
+    }
+    if (!high_water)
+        high_water = 4*chunk_size;
+
+    Local<Object> obj = constructor_template->GetFunction()->NewInstance();
+    PngEncodeStream *stream = ObjectWrap::Unwrap<PngEncodeStream>(obj);
+    stream->width = args[0]->Int32Value();
+    stream->height = args[1]->Int32Value();
+    stream->buf_type = buf_type;
+    stream->bits = bits;
+    stream->opts = opts;
+    stream->chunk_size = chunk_size;
+    stream->high_water = high_water;
+    stream->row.resize((size_t)stream->width*bytes_per_pixel(buf_type, bits));
+    stream->expected = (double)stream->row.size()*stream->height;
+    stream->pending.reserve(chunk_size);
+
+    // Kept alive until the async handle is closed.
+    ref_encode_options(opts);
+    stream->Ref();
+
+    uv_async_init(uv_default_loop(), &stream->async, UV_Deliver);
+    stream->async.data = stream;
+    uv_thread_create(&stream->thread, UV_Encode, stream);
+
+    return scope.Close(obj);
+}
+
+Handle<Value>
+PngEncodeStream::New(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngEncodeStream *stream = new PngEncodeStream();
+    stream->Wrap(args.This());
+    return args.This();
+}
+
+// Queues a Buffer of pixels for the encoding thread. room tells whether
+// there's room for more.
+const char *
+PngEncodeStream::push(Handle<Value> buf_val, bool &room)
+{
+    HandleScope scope;
+
+    if (!Buffer::HasInstance(buf_val))
+        return "First argument must be Buffer.";
+    if (input_ended)
+        return "Can't write after end().";
+
+    Local<Object> buf = buf_val->ToObject();
+    size_t len = BufferLength(buf);
+    if (written + len > expected)
+        return "More data written than width*height pixels.";
+    written += len;
+
+    uv_mutex_lock(&lock);
+    if (len) {
+        input.push_back(std::vector<char>(BufferData(buf), BufferData(buf) + len));
+        queued += len;
+        uv_cond_signal(&cond);
+    }
+    room = queued < high_water;
+    if (!room)
+        need_drain = true;
+    uv_mutex_unlock(&lock);
+    if (len)
+        wake();
+    return NULL;
+}
+
+Handle<Value>
+PngEncodeStream::Write(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngEncodeStream *stream = ObjectWrap::Unwrap<PngEncodeStream>(args.This());
+    bool room;
+    const char *err = stream->push(args[0], room);
+    if (err) return VException(err);
+    return scope.Close(Boolean::New(room));
+}
+
+// Takes an optional last Buffer. The stream errors if fewer than height rows
+// were written.
+Handle<Value>
+PngEncodeStream::End(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngEncodeStream *stream = ObjectWrap::Unwrap<PngEncodeStream>(args.This());
+    if (args.Length() >= 1 && !args[0]->IsUndefined()) {
+        bool room;
+        const char *err = stream->push(args[0], room);
+        if (err) return VException(err);
+    }
+
+    uv_mutex_lock(&stream->lock);
+    stream->input_ended = true;
+    uv_cond_signal(&stream->cond);
+    uv_mutex_unlock(&stream->lock);
+    stream->wake();
+    return Undefined();
+}
+
+// Stops the encode. Nothing is called on the stream afterwards.
+Handle<Value>
+PngEncodeStream::Destroy(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngEncodeStream *stream = ObjectWrap::Unwrap<PngEncodeStream>(args.This());
+    uv_mutex_lock(&stream->lock);
+    stream->destroyed = true;
+    uv_cond_signal(&stream->cond);
+    uv_mutex_unlock(&stream->lock);
+    stream->wake();
+    return Undefined();
+}
@@ -0,0 +1,70 @@
+#ifndef PNG_ENCODE_STREAM_H
+#define PNG_ENCODE_STREAM_H
+
+#include <node.h>
+
+#include <list>
+#include <vector>
+
+#include "common.h"
+#include "png_encoder.h"
+
+// Returned by Png.createEncodeStream(). Takes the raw pixels in write()s of
+// any size and encodes them a row at a time on a thread of its own, so only
+// what's been written but not encoded yet is kept in memory. The PNG comes
+// out through ondata as it's written. write() returns false once
+// highWaterMark bytes are waiting, ondrain is called when there's room again.
+class PngEncodeStream : public node::ObjectWrap, public PngSink, public PngRowSource {
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
+    typedef std::list<std::vector<char> > lChunk;
+
+    int width, height, bits;
+    buffer_type buf_type;
+    encode_options opts;
+    size_t chunk_size, high_water;
+    double expected, written;   // input bytes
+
+    // Shared with the encoding thread, under lock.
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    lChunk input, output;
+    size_t input_offset, queued;
+    bool input_ended, destroyed, encoded, need_drain, drain;
+    bool waiting;   // the encoding thread has used up the input
+
+    std::vector<unsigned char> row;     // encoding thread only
+    std::vector<char> pending;
+    uv_thread_t thread;
+    uv_async_t async;
+    bool idle;      // async is unref'd, see deliver
+    bool ended;
+    char *error;
+    encode_info info;
+
+    void queue_output();
+    void deliver();
+    void wake();
+    const char *push(v8::Handle<v8::Value> buf_val, bool &room);
+
+    static void UV_Encode(void *arg);
+    static void UV_Deliver(uv_async_t *handle);
+    static void UV_Close(uv_handle_t *handle);
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    PngEncodeStream();
+    ~PngEncodeStream();
+
+    void write(const char *data, unsigned int len);
+    const unsigned char *next_row();
+
+    static v8::Handle<v8::Value> Create(const v8::Arguments &args);
+
+    static v8::Handle<v8::Value> New(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Write(const v8::Arguments &args);
+    static v8::Handle<v8::Value> End(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Destroy(const v8::Arguments &args);
+};
+
+#endif
@@ -1,26 +1,36 @@
 #include <cstdlib>
+#include <cmath>
+#include <zlib.h>
 
 #include "png_encoder.h"
+#include "color_analysis.h"
+#include "quantizer.h"
+#include "encoder_session.h"
+#include "pixel_packer.h"
+#include "png_cache.h"
+#include "hash.h"
+#include "buffer_pool.h"
+#include "size_estimator.h"
 #include "common.h"
 
+// Images with less raw data than this don't get their output size estimated.
+static const size_t ESTIMATE_MIN_RAW = 1024*1024;
+
 void
 PngEncoder::png_chunk_producer(png_structp png_ptr, png_bytep data, png_size_t length)
 {
     PngEncoder *p = (PngEncoder *)png_get_io_ptr(png_ptr);
 
-    if (!p->png) {
-        p->png = (char *)malloc(sizeof(p->png)*41); // from tests pngs are at least 41 bytes
-        if (!p->png)
-            throw "malloc failed in node-png (PngEncoder::png_chunk_producer)";
-        p->mem_len = 41;
+    if (p->sink) {
+        p->sink->write((const char *)data, length);
+        p->png_len += length;
+        return;
     }
 
+    // The pool rounds up to its size classes, so the buffer grows in steps.
     if (p->png_len + length > p->mem_len) {
-        char *new_png = (char *)realloc(p->png, sizeof(char)*p->png_len + length);
-        if (!new_png)
-            throw "realloc failed in node-png (PngEncoder::png_chunk_producer).";
-        p->png = new_png;
-        p->mem_len += length;
+        p->png = (char *)BufferPool::reallocate(p->png, p->png_len + length);
+        p->mem_len = BufferPool::capacity(p->png);
     }
     memcpy(p->png + p->png_len, data, length);
     p->png_len += length;
@@ -33,17 +43,364 @@ PngEncoder::PngEncoder(unsigned char *ddata, int wwidth, int hheight,
     height = hheight;
     buf_type = bbuf_type;
     bits = bbits;
+    stride = width*bytes_per_pixel(buf_type, bits);
     png = NULL;
     png_len = 0;
     mem_len = 0;
+    has_trns = false;
+    sink = NULL;
+    source = NULL;
+    quant_indices = NULL;
 }
 
 PngEncoder::~PngEncoder() {
-    free(png);
+    BufferPool::release(png);
+    free(quant_indices);
+}
+
+// Makes pixels of the given color transparent with a tRNS chunk. The pixel is
+// in the byte order of the input buffer. Only valid for RGB and BGR buffers.
+void
+PngEncoder::set_transparent_color(const unsigned char *pixel)
+{
+    memset(&trns, 0, sizeof(trns));
+    if (buf_type == BUF_BGR) {
+        trns.blue = pixel[0];
+        trns.green = pixel[1];
+        trns.red = pixel[2];
+    }
+    else {
+        trns.red = pixel[0];
+        trns.green = pixel[1];
+        trns.blue = pixel[2];
+    }
+    has_trns = true;
+}
+
+void
+PngEncoder::set_options(const encode_options &oopts)
+{
+    opts = oopts;
+}
+
+// Bytes from the start of one row to the start of the next, for buffers with
+// padded rows. Defaults to tightly packed rows.
+void
+PngEncoder::set_stride(int sstride)
+{
+    stride = sstride;
+}
+
+// Hands the PNG to sink as it's written. get_png() then returns NULL and
+// get_png_len() the number of bytes written.
+void
+PngEncoder::set_sink(PngSink *ssink)
+{
+    sink = ssink;
+}
+
+// Takes the rows from source instead of the buffer, which can then be NULL.
+// Only the options that work a row at a time can be used: byte_order and
+// bit_depth.
+void
+PngEncoder::set_row_source(PngRowSource *ssource)
+{
+    source = ssource;
+}
+
+const unsigned char *
+PngEncoder::row_at(int y)
+{
+    return source ? source->next_row() : data+(long)y*stride;
+}
+
+// Lossy palette reduction. The result is dropped if its error is above what
+// the quality option allows, so that the buffer gets encoded losslessly.
+bool
+PngEncoder::quantize(int &color_type, Palette &palette, const unsigned int *key)
+{
+    long pixels = (long)width*height;
+    if (palette.build(data, width, height, stride, buf_type, key) &&
+        palette.size() <= opts.quant_colors)
+    {
+        color_type = PNG_COLOR_TYPE_PALETTE;
+        return true;
+    }
+
+    quant_indices = (unsigned char *)malloc(sizeof(*quant_indices) * pixels);
+    if (!quant_indices)
+        throw "malloc failed in node-png (PngEncoder::quantize).";
+
+    Quantizer quantizer(opts.quant_colors, opts.quant_dither,
+        opts.quant_iterations, opts.quant_time);
+    double mse = quantizer.quantize(data, width, height, stride, buf_type, key, quant_indices);
+
+    // quality 0 takes anything, 100 wants a PSNR of at least 50dB.
+    if (opts.quant_quality > 0) {
+        double max_mse = 65025.0 / pow(10.0, (20 + 0.3*opts.quant_quality) / 10);
+        if (mse > max_mse) {
+            free(quant_indices);
+            quant_indices = NULL;
+            return false;
+        }
+    }
+
+    palette = Palette();
+    for (int i = 0; i < quantizer.size(); i++)
+        palette.add(quantizer.color(i));
+    palette.sort_by_alpha();
+    for (int i = 0; i < quantizer.size(); i++)
+        quant_remap[i] = palette.lookup(quantizer.color(i));
+
+    info.quantized = true;
+    info.error = mse;
+    color_type = PNG_COLOR_TYPE_PALETTE;
+    return true;
+}
+
+// Smallest gray bit depth that holds all the (gray) palette colors exactly.
+static int
+exact_gray_depth(const Palette &palette)
+{
+    static const int depths[] = { 1, 2, 4 };
+    for (int d = 0; d < 3; d++) {
+        int step = 255 / ((1 << depths[d]) - 1);
+        bool exact = true;
+        for (int i = 0; i < palette.size() && exact; i++)
+            exact = (palette.color(i) & 0xFF) % step == 0;
+        if (exact)
+            return depths[d];
+    }
+    return 8;
+}
+
+// Picks the color type to write. With a session the frame is written with
+// the session's palette if it fits. With the reduce option the pixels are
+// analyzed and the cheapest color type that holds them exactly is used, with
+// the palette option an indexed PNG is written if there are at most 256
+// colors. Gray output can be forced to fewer bits per pixel with bit_depth.
+// Returns false if the buffer is best written as it is.
+bool
+PngEncoder::choose_reduction(int &color_type, int &depth, Palette &palette)
+{
+    if (bits != 8)
+        return false;
+
+    unsigned int key = 0;
+    if (has_trns)
+        key = trns.red | (trns.green << 8) | (trns.blue << 16) | 0xFF000000U;
+
+    // Session palettes keep their order between frames, so they're not
+    // sorted by alpha.
+    if (opts.session &&
+        opts.session->extend_palette(data, width, height, stride, buf_type,
+            has_trns ? &key : NULL, palette))
+    {
+        color_type = PNG_COLOR_TYPE_PALETTE;
+        depth = palette.bit_depth();
+        return true;
+    }
+    palette = Palette();
+
+    bool chosen = false;
+    int gray_depth = 8;
+
+    if (opts.quantize) {
+        chosen = quantize(color_type, palette, has_trns ? &key : NULL);
+    }
+    else if (opts.reduce) {
+        ColorAnalysis res;
+        analyze_colors(data, width, height, stride, buf_type, has_trns ? &key : NULL,
+            palette, res);
+
+        chosen = true;
+        if (res.gray && res.opaque) {
+            if (res.colors != -1)
+                gray_depth = exact_gray_depth(palette);
+            // Gray doesn't need a PLTE, so it wins ties with the palette.
+            if (res.colors == -1 || gray_depth <= palette.bit_depth())
+                color_type = PNG_COLOR_TYPE_GRAY;
+            else
+                color_type = PNG_COLOR_TYPE_PALETTE;
+        }
+        else if (res.colors != -1)
+            color_type = PNG_COLOR_TYPE_PALETTE;
+        else if (res.gray && buf_type != BUF_GRAYA)
+            color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        else if (res.opaque && (buf_type == BUF_RGBA || buf_type == BUF_BGRA))
+            color_type = PNG_COLOR_TYPE_RGB;
+        else
+            chosen = false;
+    }
+    else if (opts.palette) {
+        chosen = palette.build(data, width, height, stride, buf_type,
+            has_trns ? &key : NULL);
+        if (chosen)
+            color_type = PNG_COLOR_TYPE_PALETTE;
+    }
+
+    if (!chosen) {
+        if (buf_type != BUF_GRAY || opts.bit_depth == 0 || opts.bit_depth == 8)
+            return false;
+        color_type = PNG_COLOR_TYPE_GRAY;
+    }
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        if (!quant_indices)
+            palette.sort_by_alpha();
+        depth = palette.bit_depth();
+    }
+    else if (color_type == PNG_COLOR_TYPE_GRAY) {
+        depth = opts.bit_depth ? opts.bit_depth : gray_depth;
+        if (buf_type == BUF_GRAY && depth == 8)
+            return false;
+    }
+    return true;
+}
+
+// Converts one row of the input buffer to the reduced color type.
+void
+PngEncoder::convert_row(const unsigned char *src, unsigned char *dst, int color_type,
+    int depth, const Palette &palette)
+{
+    int bpp = bytes_per_pixel(buf_type, 8);
+    bool bgr = buf_type == BUF_BGR || buf_type == BUF_BGRA;
+
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        for (int x = 0; x < width; x++, src += bpp)
+            dst[x] = src[0] >> (8 - depth);
+        if (depth < 8)
+            pack_pixels(dst, dst, width, depth);
+        break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        for (int x = 0; x < width; x++, src += bpp) {
+            *dst++ = src[0];
+            *dst++ = 0xFF - src[bpp-1];
+        }
+        break;
+    case PNG_COLOR_TYPE_RGB:
+        for (int x = 0; x < width; x++, src += bpp) {
+            *dst++ = bgr ? src[2] : src[0];
+            *dst++ = src[1];
+            *dst++ = bgr ? src[0] : src[2];
+        }
+        break;
+    case PNG_COLOR_TYPE_PALETTE: {
+        if (quant_indices) {
+            const unsigned char *indices = quant_indices + (src - data)/stride*width;
+            for (int x = 0; x < width; x++)
+                dst[x] = quant_remap[indices[x]];
+        }
+        else {
+            unsigned int key = 0;
+            if (has_trns)
+                key = trns.red | (trns.green << 8) | (trns.blue << 16) | 0xFF000000U;
+            palette.index_row(src, width, buf_type, has_trns ? &key : NULL, dst);
+        }
+        if (depth < 8)
+            pack_pixels(dst, dst, width, depth);
+        break;
+    }
+    }
+}
+
+// Hash of everything that goes into the PNG: the parameters and options
+// first, then the pixels row by row.
+uint64_t
+PngEncoder::cache_key() const
+{
+    int params[] = {
+        width, height, buf_type, bits, has_trns, trns.red, trns.green, trns.blue,
+        opts.reduce, opts.palette, opts.bit_depth, opts.little_endian,
+        opts.quantize, opts.quant_colors, opts.quant_quality, opts.quant_dither,
+        opts.quant_iterations, opts.quant_time, opts.level
+    };
+    uint64_t key = hash_bytes((const unsigned char *)params, sizeof(params), 0);
+
+    int row_len = width*bytes_per_pixel(buf_type, bits);
+    for (int y = 0; y < height; y++)
+        key = hash_bytes(data + (long)y*stride, row_len, key);
+    return key;
 }
 
+// Encodes the buffer, or takes the PNG from the cache if there's one. With
+// a session the output depends on what was encoded before, so those aren't
+// cached, and rows from a source have no buffer to hash. With a sink a
+// cached PNG is written to it whole, a new one is encoded in memory first so
+// that it can be put in the cache.
 void
 PngEncoder::encode()
+{
+    if (opts.session && opts.band_rows) {
+        encode_banded();
+        return;
+    }
+    if (!opts.cache || opts.session || source) {
+        encode_png();
+        return;
+    }
+
+    uint64_t key = cache_key();
+    if (opts.cache->get(key, png, png_len, info)) {
+        mem_len = png_len;
+        info.cached = true;
+    }
+    else {
+        PngSink *out = sink;
+        sink = NULL;
+        try {
+            encode_png();
+        }
+        catch (const char *) {
+            sink = out;
+            throw;
+        }
+        sink = out;
+        opts.cache->put(key, png, png_len, info);
+    }
+
+    if (sink) {
+        sink->write(png, png_len);
+        BufferPool::release(png);
+        png = NULL;
+        mem_len = 0;
+    }
+}
+
+// Encodes with the session's BandedEncoder, without any reduction.
+void
+PngEncoder::encode_banded()
+{
+    unsigned short key[3] = { trns.red, trns.green, trns.blue };
+    std::vector<unsigned char> out;
+    info.bands_reused = opts.session->encode_banded(data, width, height, stride, buf_type,
+        bits, opts.little_endian, opts.band_rows, opts.level, has_trns ? key : NULL, out);
+    info.bands = (height + opts.band_rows - 1)/opts.band_rows;
+
+    if (sink) {
+        sink->write((const char *)&out[0], out.size());
+        png_len = out.size();
+    }
+    else {
+        png = (char *)BufferPool::allocate(out.size());
+        memcpy(png, &out[0], out.size());
+        png_len = mem_len = out.size();
+    }
+
+    int color_type = PNG_COLOR_TYPE_RGB_ALPHA;
+    switch (buf_type) {
+    case BUF_GRAY: color_type = PNG_COLOR_TYPE_GRAY; break;
+    case BUF_GRAYA: color_type = PNG_COLOR_TYPE_GRAY_ALPHA; break;
+    case BUF_RGB: case BUF_BGR: color_type = PNG_COLOR_TYPE_RGB; break;
+    default: break;
+    }
+    info.color_type = color_type_name(color_type);
+    info.bit_depth = bits;
+}
+
+void
+PngEncoder::encode_png()
 {
     png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr)
@@ -62,53 +419,135 @@ PngEncoder::encode()
     case BUF_GRAY:
         color_type = PNG_COLOR_TYPE_GRAY;
         break;
+    case BUF_GRAYA:
+        color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+        break;
     default:
         color_type = PNG_COLOR_TYPE_RGB_ALPHA;
     }
 
-    png_set_IHDR(png_ptr, info_ptr, width, height,
-        bits, color_type, PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
+    Palette palette;
+    int depth = bits;
+    bool reduced = false;
     png_bytep *row_pointers = NULL;
+    png_bytep row = NULL;
 
     try {
+        reduced = choose_reduction(color_type, depth, palette);
+
+        png_set_IHDR(png_ptr, info_ptr, width, height,
+            depth, color_type, PNG_INTERLACE_NONE,
+            PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+        if (color_type == PNG_COLOR_TYPE_PALETTE) {
+            png_color plte[256];
+            png_byte alpha[256];
+            for (int i = 0; i < palette.size(); i++) {
+                unsigned int c = palette.color(i);
+                plte[i].red = c;
+                plte[i].green = c >> 8;
+                plte[i].blue = c >> 16;
+                alpha[i] = c >> 24;
+            }
+            png_set_PLTE(png_ptr, info_ptr, plte, palette.size());
+            if (palette.trans_count())
+                png_set_tRNS(png_ptr, info_ptr, alpha, palette.trans_count(), NULL);
+        }
+        else if (has_trns && color_type == PNG_COLOR_TYPE_GRAY) {
+            if (trns.red == trns.green && trns.green == trns.blue) {
+                trns.gray = trns.red >> (8 - depth);
+                png_set_tRNS(png_ptr, info_ptr, NULL, 0, &trns);
+            }
+        }
+        else if (has_trns) {
+            png_set_tRNS(png_ptr, info_ptr, NULL, 0, &trns);
+        }
+
+        if (opts.level >= 0)
+            png_set_compression_level(png_ptr, opts.level);
+
+        // Saves growing the output a step at a time. Sampling costs about as
+        // much as encoding a small image, so those get zlib's bound, which
+        // they can't outgrow. The estimate is for the unreduced PNG, it would
+        // only overshoot a reduced one.
+        if (!sink && !source && !png && !reduced && height > 0) {
+            size_t raw = (size_t)height*(width*bytes_per_pixel(buf_type, bits) + 1);
+            size_t len;
+            if (raw > ESTIMATE_MIN_RAW) {
+                size_estimate est;
+                estimate_size(data, width, height, stride, buf_type, bits, opts.level, 16, est);
+                len = (size_t)(est.bytes*1.1);
+            }
+            else {
+                len = compressBound(raw) + raw/8192*12 + 1024;
+            }
+            png = (char *)BufferPool::allocate(len);
+            mem_len = BufferPool::capacity(png);
+        }
+
         png_set_write_fn(png_ptr, (void *)this, png_chunk_producer, NULL);
         png_write_info(png_ptr, info_ptr);
-        png_set_invert_alpha(png_ptr);
-
-        if (buf_type == BUF_BGR || buf_type == BUF_BGRA)
-            png_set_bgr(png_ptr);
-
-        png_bytep *row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
-        if (!row_pointers)
-            throw "malloc failed in node-png (PngEncoder::encode).";
-
-        switch (buf_type) {
-        case BUF_RGB:
-        case BUF_BGR:
-            for (int i=0; i<height; i++)
-                row_pointers[i] = data+3*i*width;
-            break;
-        case BUF_GRAY:
-            for (int i=0; i<height; i++)
-                row_pointers[i] = data+(bits/8)*i*width;
-            break;
-        default:
-            for (int i=0; i<height; i++)
-                row_pointers[i] = data+4*i*width;
+
+        if (reduced) {
+            row = (png_bytep)malloc(sizeof(*row) * width * 4);
+            if (!row)
+                throw "malloc failed in node-png (PngEncoder::encode).";
+
+            for (int i=0; i<height; i++) {
+                convert_row(row_at(i), row, color_type, depth, palette);
+                png_write_row(png_ptr, row);
+            }
+        }
+        else {
+            png_set_invert_alpha(png_ptr);
+
+            if (buf_type == BUF_BGR || buf_type == BUF_BGRA)
+                png_set_bgr(png_ptr);
+
+            int bpp = bytes_per_pixel(buf_type, bits);
+            if (bits == 16 && opts.little_endian) {
+                // Swapped a row at a time right before libpng gets it.
+                row = (png_bytep)malloc(sizeof(*row) * width * bpp);
+                if (!row)
+                    throw "malloc failed in node-png (PngEncoder::encode).";
+
+                for (int i=0; i<height; i++) {
+                    swap_bytes16(row_at(i), row, (long)width*bpp/2);
+                    png_write_row(png_ptr, row);
+                }
+            }
+            else if (source) {
+                for (int i=0; i<height; i++)
+                    png_write_row(png_ptr, (png_bytep)source->next_row());
+            }
+            else {
+                row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
+                if (!row_pointers)
+                    throw "malloc failed in node-png (PngEncoder::encode).";
+
+                for (int i=0; i<height; i++)
+                    row_pointers[i] = data+(long)i*stride;
+
+                png_write_image(png_ptr, row_pointers);
+            }
         }
 
-        png_write_image(png_ptr, row_pointers);
         png_write_end(png_ptr, NULL);
         png_destroy_write_struct(&png_ptr, &info_ptr);
         free(row_pointers);
+        free(row);
     }
     catch (const char *err) {
         png_destroy_write_struct(&png_ptr, &info_ptr);
         free(row_pointers);
+        free(row);
         throw;
     }
+
+    info.color_type = color_type_name(color_type);
+    info.bit_depth = depth;
+    info.colors = color_type == PNG_COLOR_TYPE_PALETTE ? palette.size() : 0;
+    info.reduced = reduced;
 }
 
 const char *
@@ -116,8 +555,22 @@ PngEncoder::get_png() const {
     return png;
 }
 
+// Hands the PNG over to the caller, who frees it with BufferPool::release.
+char *
+PngEncoder::release_png() {
+    char *p = png;
+    png = NULL;
+    mem_len = 0;
+    return p;
+}
+
 int
 PngEncoder::get_png_len() const {
     return png_len;
 }
 
+const encode_info &
+PngEncoder::get_info() const {
+    return info;
+}
+
@@ -2,24 +2,71 @@
 #define PNG_ENCODER_H
 
 #include <png.h>
+#include <stdint.h>
 
 #include "common.h"
+#include "palette.h"
+
+// Takes the PNG as it's written, in pieces, instead of PngEncoder collecting
+// it in memory. See PngEncoder::set_sink.
+class PngSink {
+public:
+    virtual ~PngSink() {}
+    virtual void write(const char *data, unsigned int len) = 0;
+};
+
+// Hands the encoder the rows one at a time, in order, instead of it reading
+// them from a buffer. See PngEncoder::set_row_source.
+class PngRowSource {
+public:
+    virtual ~PngRowSource() {}
+    virtual const unsigned char *next_row() = 0;
+};
 
 class PngEncoder {
-    int width, height, bits;
+    int width, height, bits, stride;
     unsigned char *data;
     char *png;
     unsigned int png_len, mem_len;
     buffer_type buf_type;
+    bool has_trns;
+    png_color_16 trns;
+    encode_options opts;
+    encode_info info;
+    PngSink *sink;
+    PngRowSource *source;
+
+    // Set when the palette came from the Quantizer, indices has one entry
+    // per pixel and remap takes them to the Palette order.
+    unsigned char *quant_indices;
+    unsigned char quant_remap[256];
+
+    bool quantize(int &color_type, Palette &palette, const unsigned int *key);
+
+    void encode_png();
+    void encode_banded();
+    const unsigned char *row_at(int y);
+
+    bool choose_reduction(int &color_type, int &depth, Palette &palette);
+    void convert_row(const unsigned char *src, unsigned char *dst, int color_type,
+        int depth, const Palette &palette);
 
 public:
     PngEncoder(unsigned char *ddata, int width, int hheight, buffer_type bbuf_type, int bbits);
     ~PngEncoder();
 
     static void png_chunk_producer(png_structp png_ptr, png_bytep data, png_size_t length);
+    void set_options(const encode_options &oopts);
+    void set_stride(int sstride);
+    void set_sink(PngSink *ssink);
+    void set_row_source(PngRowSource *ssource);
+    void set_transparent_color(const unsigned char *pixel);
     void encode();
+    uint64_t cache_key() const;
     const char *get_png() const;
+    char *release_png();
     int get_png_len() const;
+    const encode_info &get_info() const;
 };
 
 #endif
@@ -0,0 +1,71 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "png_filter.h"
+
+static inline int
+paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// Applies PNG filter type f to cur, prev being the row above or NULL for the
+// first row.
+void
+apply_filter(int f, const unsigned char *cur, const unsigned char *prev, int len, int bpp,
+    unsigned char *out)
+{
+    int i;
+    switch (f) {
+    case 0:
+        memcpy(out, cur, len);
+        break;
+    case 1:
+        memcpy(out, cur, bpp);
+        for (i = bpp; i < len; i++)
+            out[i] = cur[i] - cur[i - bpp];
+        break;
+    case 2:
+        for (i = 0; i < len; i++)
+            out[i] = cur[i] - prev[i];
+        break;
+    case 3:
+        for (i = 0; i < bpp; i++)
+            out[i] = cur[i] - prev[i]/2;
+        for (; i < len; i++)
+            out[i] = cur[i] - (cur[i - bpp] + prev[i])/2;
+        break;
+    case 4:
+        for (i = 0; i < bpp; i++)
+            out[i] = cur[i] - prev[i];
+        for (; i < len; i++)
+            out[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    }
+}
+
+// Filters cur with the filter that gives the smallest sum of absolute
+// differences, the usual heuristic. out gets the filter type byte first.
+// On the first row Up, Average and Paeth reduce to None and Sub, so only
+// those two are tried.
+void
+filter_row(const unsigned char *cur, const unsigned char *prev, int len, int bpp,
+    unsigned char *out, unsigned char *scratch)
+{
+    long best_sum = -1;
+    for (int f = 0; f < (prev ? 5 : 2); f++) {
+        apply_filter(f, cur, prev, len, bpp, scratch);
+        long sum = 0;
+        for (int i = 0; i < len && (best_sum == -1 || sum < best_sum); i++)
+            sum += scratch[i] < 128 ? scratch[i] : 256 - scratch[i];
+        if (best_sum == -1 || sum < best_sum) {
+            best_sum = sum;
+            out[0] = f;
+            memcpy(out + 1, scratch, len);
+        }
+    }
+}
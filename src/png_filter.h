@@ -0,0 +1,13 @@
+#ifndef PNG_FILTER_H
+#define PNG_FILTER_H
+
+// PNG row filters, for the code that writes IDAT data itself (BandedEncoder)
+// or needs to know what libpng would compress (the size estimator). bpp is
+// bytes per pixel, rounded up to 1.
+
+void apply_filter(int f, const unsigned char *cur, const unsigned char *prev, int len,
+    int bpp, unsigned char *out);
+void filter_row(const unsigned char *cur, const unsigned char *prev, int len, int bpp,
+    unsigned char *out, unsigned char *scratch);
+
+#endif
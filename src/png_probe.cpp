@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <cstring>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "png_probe.h"
+
+static const unsigned char SIGNATURE[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+static unsigned int
+get32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static bool
+valid_depth(int color_type, int depth)
+{
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+    case PNG_COLOR_TYPE_PALETTE:
+        return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+    case PNG_COLOR_TYPE_RGB:
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+    case PNG_COLOR_TYPE_RGB_ALPHA:
+        return depth == 8 || depth == 16;
+    default:
+        return false;
+    }
+}
+
+void
+probe_png(const unsigned char *data, size_t len, bool check_crc, png_probe &probe)
+{
+    if (len < 8 || memcmp(data, SIGNATURE, 8) != 0)
+        throw "Not a PNG file.";
+
+    size_t pos = 8;
+    bool first = true;
+    while (pos + 8 <= len) {
+        unsigned int chunk_len = get32(data + pos);
+        const unsigned char *type = data + pos + 4;
+        const unsigned char *chunk = type + 4;
+        if (chunk_len > 0x7fffffff)
+            throw "Bad chunk length.";
+        for (int i = 0; i < 4; i++) {
+            if (!((type[i] >= 'A' && type[i] <= 'Z') || (type[i] >= 'a' && type[i] <= 'z')))
+                throw "Bad chunk type.";
+        }
+
+        std::string name((const char *)type, 4);
+        if (first && name != "IHDR")
+            throw "IHDR isn't the first chunk.";
+
+        // Only the IHDR has to be all there, the rest is counted as far as
+        // the data goes.
+        bool whole = len - pos - 8 >= (size_t)chunk_len + 4;
+        if (whole && check_crc) {
+            uLong crc = crc32(crc32(0L, Z_NULL, 0), type, chunk_len + 4);
+            if (crc != get32(chunk + chunk_len))
+                throw "CRC error.";
+        }
+
+        if (first) {
+            if (chunk_len != 13)
+                throw "Bad IHDR.";
+            if (!whole)
+                throw "PNG data ends inside the IHDR.";
+            unsigned int width = get32(chunk);
+            unsigned int height = get32(chunk + 4);
+            int depth = chunk[8];
+            int color_type = chunk[9];
+            if (width == 0 || height == 0 || width > 0x7fffffff || height > 0x7fffffff)
+                throw "Bad IHDR, image size.";
+            if (!valid_depth(color_type, depth))
+                throw "Bad IHDR, color type and bit depth.";
+            if (chunk[12] > 1)
+                throw "Bad IHDR, interlace method.";
+            probe.width = width;
+            probe.height = height;
+            probe.bit_depth = depth;
+            probe.color_type = color_type_name(color_type);
+            probe.interlaced = chunk[12] == 1;
+            first = false;
+        }
+        else if (name == "IDAT") {
+            probe.idat_bytes += chunk_len;
+        }
+        else if (name == "acTL" || name == "fcTL" || name == "fdAT") {
+            probe.animated = true;
+            if (name == "acTL" && chunk_len >= 4 && whole)
+                probe.frames = get32(chunk);
+        }
+
+        if (std::find(probe.chunks.begin(), probe.chunks.end(), name) == probe.chunks.end())
+            probe.chunks.push_back(name);
+
+        if (name == "IEND") {
+            probe.complete = whole;
+            break;
+        }
+        if (!whole)
+            break;
+        pos += 12 + (size_t)chunk_len;
+    }
+
+    if (first)
+        throw "PNG data ends before the IHDR.";
+}
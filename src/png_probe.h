@@ -0,0 +1,31 @@
+#ifndef PNG_PROBE_H
+#define PNG_PROBE_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// What a PNG is, from its IHDR and chunk list alone.
+struct png_probe {
+    int width, height;
+    int bit_depth;
+    const char *color_type;
+    bool interlaced;
+    double idat_bytes;  // data in all the IDAT chunks
+    bool animated;      // has APNG chunks (acTL, fcTL or fdAT)
+    int frames;         // from acTL, 0 if there's none
+    bool complete;      // IEND was reached, otherwise the data ends early
+    std::vector<std::string> chunks;    // chunk types, in order of first appearance
+
+    png_probe() : width(0), height(0), bit_depth(0), color_type(NULL), interlaced(false),
+        idat_bytes(0), animated(false), frames(0), complete(false) {}
+};
+
+// Walks the chunks of the PNG in data without decompressing anything, the
+// chunk data is only looked at to check CRCs if check_crc is set. Data that
+// stops between or inside chunks is fine, complete tells. Throws const char *
+// if it isn't a PNG, the IHDR is bad or a CRC doesn't match.
+void probe_png(const unsigned char *data, size_t len, bool check_crc, png_probe &probe);
+
+#endif
@@ -0,0 +1,279 @@
+#include <cstdlib>
+#include <cstring>
+
+#include "png_read_stream.h"
+#include "png.h"
+#include "buffer_compat.h"
+
+using namespace v8;
+using namespace node;
+
+Persistent<FunctionTemplate> PngReadStream::constructor_template;
+
+// Not exported, streams only come from Png's createReadStream().
+void
+PngReadStream::Initialize(Handle<Object> target)
+{
+    HandleScope scope;
+
+    Local<FunctionTemplate> t = FunctionTemplate::New(New);
+    constructor_template = Persistent<FunctionTemplate>::New(t);
+    t->InstanceTemplate()->SetInternalFieldCount(1);
+    NODE_SET_PROTOTYPE_METHOD(t, "pause", Pause);
+    NODE_SET_PROTOTYPE_METHOD(t, "resume", Resume);
+    NODE_SET_PROTOTYPE_METHOD(t, "destroy", Destroy);
+}
+
+PngReadStream::PngReadStream() :
+    png(NULL), buf_data(NULL), chunk_size(0), high_water(0), queued(0),
+    destroyed(false), encoded(false), paused(false), ended(false), delivering(false),
+    idle(false), error(NULL)
+{
+    uv_mutex_init(&lock);
+    uv_cond_init(&cond);
+}
+
+PngReadStream::~PngReadStream()
+{
+    uv_cond_destroy(&cond);
+    uv_mutex_destroy(&lock);
+    free(error);
+}
+
+// PngSink, called by the encoder on the encoding thread.
+void
+PngReadStream::write(const char *data, unsigned int len)
+{
+    pending.insert(pending.end(), data, data + len);
+    if (pending.size() >= chunk_size)
+        queue_chunk();
+}
+
+// Moves pending to the queue for the loop thread, first waiting for the queue
+// to drop below the high water mark.
+void
+PngReadStream::queue_chunk()
+{
+    uv_mutex_lock(&lock);
+    while (queued >= high_water && !destroyed)
+        uv_cond_wait(&cond, &lock);
+    if (destroyed) {
+        uv_mutex_unlock(&lock);
+        throw "Stream destroyed.";
+    }
+    chunks.push_back(std::vector<char>());
+    chunks.back().swap(pending);
+    queued += chunks.back().size();
+    uv_mutex_unlock(&lock);
+
+    pending.reserve(chunk_size);
+    uv_async_send(&async);
+}
+
+void
+PngReadStream::UV_Encode(void *arg)
+{
+    PngReadStream *stream = (PngReadStream *)arg;
+    Png *png = stream->png;
+
+    try {
+        PngEncoder encoder((unsigned char *)stream->buf_data + png->offset, png->width,
+            png->height, png->buf_type, png->bits);
+        encoder.set_stride(png->stride);
+        encoder.set_options(stream->opts);
+        encoder.set_sink(stream);
+        encoder.encode();
+        stream->info = encoder.get_info();
+        if (!stream->pending.empty())
+            stream->queue_chunk();
+    }
+    catch (const char *err) {
+        stream->error = strdup(err);
+    }
+
+    uv_mutex_lock(&stream->lock);
+    stream->encoded = true;
+    uv_mutex_unlock(&stream->lock);
+    uv_async_send(&stream->async);
+}
+
+void
+PngReadStream::UV_Deliver(uv_async_t *handle)
+{
+    ((PngReadStream *)handle->data)->deliver();
+}
+
+void
+PngReadStream::UV_Close(uv_handle_t *handle)
+{
+    ((PngReadStream *)handle->data)->Unref();
+}
+
+// Runs on the loop thread. Hands the queued chunks to ondata until paused,
+// then onend or onerror once the encode is done and the queue is empty.
+// Chunks queued after destroy() are dropped and no handlers are called.
+void
+PngReadStream::deliver()
+{
+    if (ended || delivering)
+        return;
+
+    HandleScope scope;
+    delivering = true;
+
+    bool finished = false;
+    while (!paused || destroyed) {
+        std::vector<char> chunk;
+        uv_mutex_lock(&lock);
+        if (chunks.empty()) {
+            finished = encoded;
+            uv_mutex_unlock(&lock);
+            break;
+        }
+        chunk.swap(chunks.front());
+        chunks.pop_front();
+        queued -= chunk.size();
+        uv_cond_signal(&cond);
+        uv_mutex_unlock(&lock);
+
+        if (destroyed)
+            continue;
+
+        Buffer *buf = Buffer::New(chunk.size());
+        memcpy(BufferData(buf), &chunk[0], chunk.size());
+        Handle<Value> argv[1] = { buf->handle_ };
+        call_handler(handle_, "ondata", 1, argv);
+    }
+
+    delivering = false;
+    if (!finished)
+        return;
+
+    ended = true;
+    uv_thread_join(&thread);
+    if (!destroyed) {
+        Handle<Value> argv[1];
+        if (error) {
+            argv[0] = ErrorException(error);
+            call_handler(handle_, "onerror", 1, argv);
+        }
+        else {
+            png->info = info;
+            argv[0] = encode_info_object(info);
+            call_handler(handle_, "onend", 1, argv);
+        }
+    }
+
+    unref_encode_options(opts);
+    png->Unref();
+    uv_close((uv_handle_t *)&async, UV_Close);
+}
+
+// Starts encoding the Png into a new stream. opts are the encode options
+// plus chunkSize and highWaterMark.
+Handle<Value>
+PngReadStream::Create(Png *png, Handle<Object> png_obj, char *buf_data,
+    Handle<Value> opts_val)
+{
+    HandleScope scope;
+
+    encode_options opts;
+    size_t chunk_size = 64*1024;
+    size_t high_water = 0;
+    if (!opts_val->IsUndefined()) {
+        const char *err = parse_encode_options(opts_val, opts);
+        if (!err)
+            err = parse_stream_options(opts_val, chunk_size, high_water);
+        if (err) return VException(err);
+    }
+    if (!high_water)
+        high_water = 4*chunk_size;
+    opts.cache = NULL;  // chunks go out as they're encoded
+
+    Local<Object> obj = constructor_template->GetFunction()->NewInstance();
+    PngReadStream *stream = ObjectWrap::Unwrap<PngReadStream>(obj);
+    stream->png = png;
+    stream->buf_data = buf_data;
+    stream->opts = opts;
+    stream->chunk_size = chunk_size;
+    stream->high_water = high_water;
+    stream->pending.reserve(chunk_size);
+
+    // The Png keeps the buffer alive, the stream keeps itself alive until
+    // its async handle is closed.
+    obj->SetHiddenValue(String::New("png"), png_obj);
+    ref_encode_options(opts);
+    png->Ref();
+    stream->Ref();
+
+    uv_async_init(uv_default_loop(), &stream->async, UV_Deliver);
+    stream->async.data = stream;
+    uv_thread_create(&stream->thread, UV_Encode, stream);
+
+    return scope.Close(obj);
+}
+
+Handle<Value>
+PngReadStream::New(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngReadStream *stream = new PngReadStream();
+    stream->Wrap(args.This());
+    return args.This();
+}
+
+// A paused stream can't get anywhere until resume() or destroy(), the
+// encoding thread stops at the high water mark. So the async handle is
+// unref'd meanwhile and a stream that's been dropped paused doesn't keep the
+// loop alive.
+void
+PngReadStream::set_idle(bool iidle)
+{
+    if (ended || idle == iidle)
+        return;
+    if (iidle)
+        uv_unref((uv_handle_t *)&async);
+    else
+        uv_ref((uv_handle_t *)&async);
+    idle = iidle;
+}
+
+Handle<Value>
+PngReadStream::Pause(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngReadStream *stream = ObjectWrap::Unwrap<PngReadStream>(args.This());
+    stream->paused = true;
+    stream->set_idle(true);
+    return Undefined();
+}
+
+Handle<Value>
+PngReadStream::Resume(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngReadStream *stream = ObjectWrap::Unwrap<PngReadStream>(args.This());
+    stream->paused = false;
+    stream->set_idle(false);
+    stream->deliver();
+    return Undefined();
+}
+
+// Stops the encode. Nothing is called on the stream afterwards.
+Handle<Value>
+PngReadStream::Destroy(const Arguments &args)
+{
+    HandleScope scope;
+
+    PngReadStream *stream = ObjectWrap::Unwrap<PngReadStream>(args.This());
+    uv_mutex_lock(&stream->lock);
+    stream->destroyed = true;
+    uv_cond_signal(&stream->cond);
+    uv_mutex_unlock(&stream->lock);
+    stream->set_idle(false);
+    stream->deliver();
+    return Undefined();
+}
@@ -0,0 +1,68 @@
+#ifndef PNG_READ_STREAM_H
+#define PNG_READ_STREAM_H
+
+#include <node.h>
+
+#include <list>
+#include <vector>
+
+#include "common.h"
+#include "png_encoder.h"
+
+class Png;
+
+// Returned by Png's createReadStream(). Encodes on a thread of its own and
+// hands the PNG to the ondata callback in chunks as they're written, instead
+// of in one Buffer at the end. The thread waits when highWaterMark bytes are
+// queued and not taken yet, which is how pause() holds back the encode - in
+// the thread pool that would tie up a worker for as long as it's paused.
+class PngReadStream : public node::ObjectWrap, public PngSink {
+    static v8::Persistent<v8::FunctionTemplate> constructor_template;
+
+    typedef std::list<std::vector<char> > lChunk;
+
+    Png *png;
+    char *buf_data;
+    encode_options opts;
+    size_t chunk_size, high_water;
+
+    // Shared with the encoding thread, under lock.
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    lChunk chunks;
+    size_t queued;
+    bool destroyed, encoded;
+
+    std::vector<char> pending;  // encoding thread only, filled up to chunk_size
+    uv_thread_t thread;
+    uv_async_t async;
+    bool paused, ended, delivering;
+    bool idle;      // async is unref'd while paused
+    char *error;
+    encode_info info;
+
+    void queue_chunk();
+    void deliver();
+    void set_idle(bool iidle);
+
+    static void UV_Encode(void *arg);
+    static void UV_Deliver(uv_async_t *handle);
+    static void UV_Close(uv_handle_t *handle);
+
+public:
+    static void Initialize(v8::Handle<v8::Object> target);
+    PngReadStream();
+    ~PngReadStream();
+
+    void write(const char *data, unsigned int len);
+
+    static v8::Handle<v8::Value> Create(Png *png, v8::Handle<v8::Object> png_obj,
+        char *buf_data, v8::Handle<v8::Value> opts_val);
+
+    static v8::Handle<v8::Value> New(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Pause(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Resume(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Destroy(const v8::Arguments &args);
+};
+
+#endif
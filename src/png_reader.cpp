@@ -0,0 +1,222 @@
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+
+#include "png_reader.h"
+#include "buffer_pool.h"
+
+// The largest Buffer node will make.
+static const uint64_t MAX_PIXELS_LEN = 0x3fffffff;
+
+PngReader::PngReader(buffer_type oout_type) :
+    out_type(oout_type), png_ptr(NULL), info_ptr(NULL), has_header(false), finished(false),
+    rows_done(0), pixels(NULL)
+{
+    error[0] = '\0';
+}
+
+PngReader::~PngReader()
+{
+    if (png_ptr)
+        png_destroy_read_struct(&png_ptr, info_ptr ? &info_ptr : NULL, NULL);
+    BufferPool::release(pixels);
+}
+
+// libpng errors come here and jump back to push(), which throws the message.
+void
+PngReader::error_fn(png_structp png_ptr, png_const_charp msg)
+{
+    PngReader *reader = (PngReader *)png_get_error_ptr(png_ptr);
+    snprintf(reader->error, sizeof(reader->error), "%s.", msg);
+    longjmp(png_jmpbuf(png_ptr), 1);
+}
+
+void
+PngReader::warning_fn(png_structp png_ptr, png_const_charp msg)
+{
+}
+
+// Everything up to the first IDAT is read. Sets up the transforms to get to
+// out_type and allocates the pixels.
+void
+PngReader::info_callback(png_structp png_ptr, png_infop info_ptr)
+{
+    PngReader *reader = (PngReader *)png_get_progressive_ptr(png_ptr);
+    decode_info &info = reader->info;
+
+    info.width = png_get_image_width(png_ptr, info_ptr);
+    info.height = png_get_image_height(png_ptr, info_ptr);
+    info.bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    info.color_type = color_type_name(png_get_color_type(png_ptr, info_ptr));
+    info.interlaced = png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE;
+
+    reader->set_transforms();
+    png_read_update_info(png_ptr, info_ptr);
+
+    info.row_bytes = png_get_rowbytes(png_ptr, info_ptr);
+    if (info.row_bytes != info.width*bytes_per_pixel(reader->out_type, 8))
+        png_error(png_ptr, "Unexpected row size after transforms");
+    if ((uint64_t)info.row_bytes*info.height > MAX_PIXELS_LEN)
+        png_error(png_ptr, "PNG too big to decode");
+
+    // BufferPool throws, that can't go through libpng.
+    bool failed = false;
+    try {
+        reader->pixels = (unsigned char *)BufferPool::allocate(reader->get_pixels_len());
+    }
+    catch (const char *) {
+        failed = true;
+    }
+    if (failed)
+        png_error(png_ptr, "malloc failed in node-png (PngReader::info_callback)");
+
+    reader->has_header = true;
+}
+
+void
+PngReader::set_transforms()
+{
+    int color_type = png_get_color_type(png_ptr, info_ptr);
+    bool has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) ||
+        png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
+    bool has_color = color_type & PNG_COLOR_MASK_COLOR;
+    bool want_alpha = out_type == BUF_RGBA || out_type == BUF_BGRA || out_type == BUF_GRAYA;
+    bool want_color = out_type != BUF_GRAY && out_type != BUF_GRAYA;
+
+    // Palettes to RGB, gray below 8 bits to 8 and tRNS to an alpha channel.
+    png_set_expand(png_ptr);
+    if (info.bit_depth == 16)
+        png_set_strip_16(png_ptr);
+
+    if (want_color && !has_color)
+        png_set_gray_to_rgb(png_ptr);
+    else if (!want_color && has_color)
+        png_set_rgb_to_gray_fixed(png_ptr, 1, -1, -1);
+
+    if (want_alpha && !has_alpha)
+        png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+    else if (!want_alpha && has_alpha)
+        png_set_strip_alpha(png_ptr);
+
+    if (out_type == BUF_BGR || out_type == BUF_BGRA)
+        png_set_bgr(png_ptr);
+
+    if (info.interlaced)
+        png_set_interlace_handling(png_ptr);
+}
+
+// Turns PNG alpha into the module's, where 0 is opaque.
+void
+PngReader::invert_alpha(unsigned char *row, int count)
+{
+    if (out_type != BUF_RGBA && out_type != BUF_BGRA && out_type != BUF_GRAYA)
+        return;
+
+    int bpp = bytes_per_pixel(out_type, 8);
+    long n = (long)count*info.width;
+    for (unsigned char *p = row + bpp - 1; n > 0; p += bpp, n--)
+        *p = 255 - *p;
+}
+
+// Rows of interlaced PNGs come in every pass and are only complete after the
+// last one, the others are final as they come.
+void
+PngReader::row_callback(png_structp png_ptr, png_bytep row, png_uint_32 y, int pass)
+{
+    if (!row)
+        return;
+
+    PngReader *reader = (PngReader *)png_get_progressive_ptr(png_ptr);
+    unsigned char *dst = reader->pixels + (size_t)y*reader->info.row_bytes;
+    png_progressive_combine_row(png_ptr, dst, row);
+    if (!reader->info.interlaced) {
+        reader->invert_alpha(dst, 1);
+        reader->rows_done = y + 1;
+    }
+}
+
+void
+PngReader::end_callback(png_structp png_ptr, png_infop info_ptr)
+{
+    PngReader *reader = (PngReader *)png_get_progressive_ptr(png_ptr);
+    if (reader->info.interlaced)
+        reader->invert_alpha(reader->pixels, reader->info.height);
+    reader->rows_done = reader->info.height;
+    reader->finished = true;
+}
+
+// Feeds the next piece of the PNG, any length. Rows get decoded as far as
+// the data goes.
+void
+PngReader::push(const unsigned char *data, size_t len)
+{
+    if (error[0])
+        throw (const char *)error;
+    if (finished)
+        throw "PNG already ended.";
+
+    if (!png_ptr) {
+        png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, (png_voidp)this,
+            error_fn, warning_fn);
+        if (!png_ptr)
+            throw "png_create_read_struct failed.";
+
+        info_ptr = png_create_info_struct(png_ptr);
+        if (!info_ptr)
+            throw "png_create_info_struct failed.";
+
+        png_set_progressive_read_fn(png_ptr, (png_voidp)this, info_callback, row_callback,
+            end_callback);
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+        throw (const char *)error;
+
+    png_process_data(png_ptr, info_ptr, (png_bytep)data, len);
+}
+
+// The whole PNG in one piece.
+void
+PngReader::decode(const unsigned char *data, size_t len)
+{
+    push(data, len);
+    if (!finished)
+        throw "PNG data ends early.";
+}
+
+bool
+PngReader::header_read() const
+{
+    return has_header;
+}
+
+bool
+PngReader::is_finished() const
+{
+    return finished;
+}
+
+int
+PngReader::get_rows_done() const
+{
+    return rows_done;
+}
+
+const decode_info &
+PngReader::get_info() const
+{
+    return info;
+}
+
+const unsigned char *
+PngReader::get_pixels() const
+{
+    return pixels;
+}
+
+size_t
+PngReader::get_pixels_len() const
+{
+    return (size_t)info.row_bytes*info.height;
+}
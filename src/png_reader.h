@@ -0,0 +1,60 @@
+#ifndef PNG_READER_H
+#define PNG_READER_H
+
+#include <png.h>
+
+#include "common.h"
+
+// What the PNG being read is, known once its header is through.
+struct decode_info {
+    int width, height;
+    int bit_depth;
+    const char *color_type;
+    bool interlaced;
+    int row_bytes;      // of the decoded rows
+
+    decode_info() : width(0), height(0), bit_depth(0), color_type(NULL),
+        interlaced(false), row_bytes(0) {}
+};
+
+// Decodes a PNG with libpng's progressive reader into 8 bit pixels of the
+// given buffer type, alpha inverted like the encoder takes it. Data can be
+// pushed in pieces as it arrives, get_rows_done() tells how many rows from the
+// top are final. Interlaced PNGs only have their rows final at the end.
+// Throws const char * on bad data, the reader is done with after that. The
+// message lives in the reader, so copy it before the reader goes away.
+class PngReader {
+    buffer_type out_type;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    decode_info info;
+    bool has_header, finished;
+    int rows_done;
+    unsigned char *pixels;
+    char error[256];
+
+    static void error_fn(png_structp png_ptr, png_const_charp msg);
+    static void warning_fn(png_structp png_ptr, png_const_charp msg);
+    static void info_callback(png_structp png_ptr, png_infop info_ptr);
+    static void row_callback(png_structp png_ptr, png_bytep row, png_uint_32 y, int pass);
+    static void end_callback(png_structp png_ptr, png_infop info_ptr);
+
+    void set_transforms();
+    void invert_alpha(unsigned char *row, int count);
+
+public:
+    PngReader(buffer_type oout_type);
+    ~PngReader();
+
+    void push(const unsigned char *data, size_t len);
+    void decode(const unsigned char *data, size_t len);
+
+    bool header_read() const;
+    bool is_finished() const;
+    int get_rows_done() const;
+    const decode_info &get_info() const;
+    const unsigned char *get_pixels() const;
+    size_t get_pixels_len() const;
+};
+
+#endif
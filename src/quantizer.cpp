@@ -0,0 +1,296 @@
+#include <algorithm>
+#include <cstdlib>
+
+#include "quantizer.h"
+#include "palette.h"
+
+// Histogram bins have 5 bits of red, green and blue and 3 bits of alpha.
+static const int HIST_SIZE = 1 << 18;
+
+static inline int
+bin_of(unsigned int c)
+{
+    return ((c & 0xF8) << 10) | ((c >> 8 & 0xF8) << 5) | (c >> 16 & 0xF8) | (c >> 29);
+}
+
+static inline int
+channel(unsigned int c, int ch)
+{
+    return (c >> (ch*8)) & 0xFF;
+}
+
+static inline unsigned int
+read_pixel(const unsigned char *p, buffer_type buf_type, const unsigned int *color_key)
+{
+    unsigned int c = pack_pixel(p, buf_type);
+    if (color_key && c == *color_key)
+        return 0;
+    // All fully transparent pixels look the same.
+    if ((c >> 24) == 0)
+        return 0;
+    return c;
+}
+
+static inline int
+distance(unsigned int a, unsigned int b)
+{
+    int d = 0;
+    for (int ch = 0; ch < 4; ch++) {
+        int x = channel(a, ch) - channel(b, ch);
+        d += x*x;
+    }
+    return d;
+}
+
+Quantizer::Quantizer(int mmax_colors, bool ddither, int iiterations, int ttime_budget) :
+    max_colors(mmax_colors), iterations(iiterations), time_budget(ttime_budget),
+    dither(ddither) {}
+
+void
+Quantizer::build_histogram(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, const unsigned int *color_key)
+{
+    int bpp = bytes_per_pixel(buf_type, 8);
+
+    std::vector<int> slot(HIST_SIZE, -1);
+    for (int y = 0; y < height; y++) {
+        const unsigned char *p = data + (long)y*stride;
+        for (int x = 0; x < width; x++, p += bpp) {
+            unsigned int c = read_pixel(p, buf_type, color_key);
+            int b = bin_of(c);
+            if (slot[b] == -1) {
+                slot[b] = bins.size();
+                Bin bin = { 0, { 0, 0, 0, 0 } };
+                bins.push_back(bin);
+            }
+            Bin &bin = bins[slot[b]];
+            bin.count++;
+            for (int ch = 0; ch < 4; ch++)
+                bin.sum[ch] += channel(c, ch);
+        }
+    }
+}
+
+static inline unsigned int
+bin_mean(const double *sum, unsigned int count)
+{
+    unsigned int c = 0;
+    for (int ch = 0; ch < 4; ch++)
+        c |= (unsigned int)(sum[ch]/count + 0.5) << (ch*8);
+    return c;
+}
+
+// Finds the channel along which the box's bins are spread the most.
+void
+Quantizer::measure(Box &box)
+{
+    int lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+    box.count = 0;
+    for (int i = box.begin; i < box.end; i++) {
+        unsigned int c = bin_mean(bins[i].sum, bins[i].count);
+        for (int ch = 0; ch < 4; ch++) {
+            if (channel(c, ch) < lo[ch]) lo[ch] = channel(c, ch);
+            if (channel(c, ch) > hi[ch]) hi[ch] = channel(c, ch);
+        }
+        box.count += bins[i].count;
+    }
+    box.channel = 0;
+    box.range = -1;
+    for (int ch = 0; ch < 4; ch++) {
+        if (hi[ch] - lo[ch] > box.range) {
+            box.range = hi[ch] - lo[ch];
+            box.channel = ch;
+        }
+    }
+}
+
+struct bin_less {
+    int ch;
+    bin_less(int cch) : ch(cch) {}
+    template <class B> bool operator()(const B &a, const B &b) const {
+        return a.sum[ch]/a.count < b.sum[ch]/b.count;
+    }
+};
+
+void
+Quantizer::median_cut()
+{
+    std::vector<Box> boxes;
+    Box all = { 0, (int)bins.size(), 0, 0, 0 };
+    measure(all);
+    boxes.push_back(all);
+
+    while ((int)boxes.size() < max_colors) {
+        // Split the box with the most pixels times spread.
+        int best = -1;
+        double best_score = 0;
+        for (size_t i = 0; i < boxes.size(); i++) {
+            if (boxes[i].end - boxes[i].begin < 2)
+                continue;
+            double score = (double)boxes[i].count * boxes[i].range;
+            if (score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+        if (best == -1)
+            break;
+
+        Box box = boxes[best];
+        std::sort(bins.begin() + box.begin, bins.begin() + box.end, bin_less(box.channel));
+
+        unsigned int half = 0;
+        int mid = box.begin;
+        while (mid < box.end - 1 && half + bins[mid].count <= box.count/2)
+            half += bins[mid++].count;
+        if (mid == box.begin)
+            mid++;
+
+        Box lo = { box.begin, mid, 0, 0, 0 }, hi = { mid, box.end, 0, 0, 0 };
+        measure(lo);
+        measure(hi);
+        boxes[best] = lo;
+        boxes.push_back(hi);
+    }
+
+    colors.clear();
+    for (size_t i = 0; i < boxes.size(); i++) {
+        double sum[4] = { 0, 0, 0, 0 };
+        for (int j = boxes[i].begin; j < boxes[i].end; j++) {
+            for (int ch = 0; ch < 4; ch++)
+                sum[ch] += bins[j].sum[ch];
+        }
+        colors.push_back(bin_mean(sum, boxes[i].count));
+    }
+}
+
+// k-means passes over the histogram bins, stopped early by the time budget.
+void
+Quantizer::refine()
+{
+    uint64_t start = uv_hrtime();
+    std::vector<double> sums(colors.size()*4);
+    std::vector<double> counts(colors.size());
+
+    for (int it = 0; it < iterations; it++) {
+        std::fill(sums.begin(), sums.end(), 0);
+        std::fill(counts.begin(), counts.end(), 0);
+        for (size_t i = 0; i < bins.size(); i++) {
+            unsigned int c = bin_mean(bins[i].sum, bins[i].count);
+            int best = 0, best_d = distance(c, colors[0]);
+            for (size_t k = 1; k < colors.size() && best_d; k++) {
+                int d = distance(c, colors[k]);
+                if (d < best_d) {
+                    best_d = d;
+                    best = k;
+                }
+            }
+            for (int ch = 0; ch < 4; ch++)
+                sums[best*4 + ch] += bins[i].sum[ch];
+            counts[best] += bins[i].count;
+        }
+        for (size_t k = 0; k < colors.size(); k++) {
+            if (counts[k] > 0)
+                colors[k] = bin_mean(&sums[k*4], counts[k]);
+        }
+        if (time_budget > 0 && (uv_hrtime() - start)/1000000 >= (uint64_t)time_budget)
+            break;
+    }
+}
+
+// Palette entry closest to color, cached per histogram bin.
+int
+Quantizer::nearest(unsigned int color)
+{
+    int b = bin_of(color);
+    if (nearest_cache[b] != -1)
+        return nearest_cache[b];
+
+    int best = 0, best_d = distance(color, colors[0]);
+    for (size_t k = 1; k < colors.size(); k++) {
+        int d = distance(color, colors[k]);
+        if (d < best_d) {
+            best_d = d;
+            best = k;
+        }
+    }
+    nearest_cache[b] = best;
+    return best;
+}
+
+static inline int
+clamp(int v)
+{
+    return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// Quantizes the buffer, writing one palette index per pixel to indices.
+// Returns the mean squared error per channel.
+double
+Quantizer::quantize(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, const unsigned int *color_key, unsigned char *indices)
+{
+    long pixels = (long)width*height;
+    int bpp = bytes_per_pixel(buf_type, 8);
+    int channels = (buf_type == BUF_RGBA || buf_type == BUF_BGRA || buf_type == BUF_GRAYA ||
+        color_key) ? 4 : 3;
+
+    bins.clear();
+    build_histogram(data, width, height, stride, buf_type, color_key);
+    median_cut();
+    refine();
+    nearest_cache.assign(HIST_SIZE, -1);
+
+    double err = 0;
+    if (!dither) {
+        for (int y = 0; y < height; y++) {
+            const unsigned char *p = data + (long)y*stride;
+            unsigned char *out = indices + (long)y*width;
+            for (int x = 0; x < width; x++, p += bpp) {
+                unsigned int c = read_pixel(p, buf_type, color_key);
+                out[x] = nearest(c);
+                err += distance(c, colors[out[x]]);
+            }
+        }
+        return err / (pixels*channels);
+    }
+
+    // Floyd-Steinberg, the errors of the current and the next row are kept
+    // with one pixel of padding on both sides.
+    std::vector<int> cur((width + 2)*4, 0), next((width + 2)*4, 0);
+    for (int y = 0; y < height; y++) {
+        std::fill(next.begin(), next.end(), 0);
+        for (int x = 0; x < width; x++) {
+            long i = (long)y*width + x;
+            unsigned int orig = read_pixel(data + (long)y*stride + x*bpp, buf_type, color_key);
+            unsigned int c = 0;
+            for (int ch = 0; ch < 4; ch++)
+                c |= clamp(channel(orig, ch) + cur[(x+1)*4 + ch]/16) << (ch*8);
+            int index = nearest(c);
+            indices[i] = index;
+            err += distance(orig, colors[index]);
+            for (int ch = 0; ch < 4; ch++) {
+                int e = channel(c, ch) - channel(colors[index], ch);
+                cur[(x+2)*4 + ch] += e*7;
+                next[x*4 + ch] += e*3;
+                next[(x+1)*4 + ch] += e*5;
+                next[(x+2)*4 + ch] += e;
+            }
+        }
+        cur.swap(next);
+    }
+    return err / (pixels*channels);
+}
+
+int
+Quantizer::size() const
+{
+    return colors.size();
+}
+
+unsigned int
+Quantizer::color(int index) const
+{
+    return colors[index];
+}
+
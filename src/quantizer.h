@@ -0,0 +1,46 @@
+#ifndef QUANTIZER_H
+#define QUANTIZER_H
+
+#include <vector>
+
+#include "common.h"
+
+// Lossy palette reduction: median cut on a color histogram, refined with a
+// few k-means passes, then optionally Floyd-Steinberg dithered.
+class Quantizer {
+    struct Bin {
+        unsigned int count;
+        double sum[4];
+    };
+
+    struct Box {
+        int begin, end;
+        unsigned int count;
+        int channel, range;
+    };
+
+    int max_colors, iterations, time_budget;
+    bool dither;
+
+    std::vector<Bin> bins;
+    std::vector<unsigned int> colors;
+    std::vector<short> nearest_cache;
+
+    void build_histogram(const unsigned char *data, int width, int height, int stride,
+        buffer_type buf_type, const unsigned int *color_key);
+    void measure(Box &box);
+    void median_cut();
+    void refine();
+    int nearest(unsigned int color);
+
+public:
+    Quantizer(int mmax_colors, bool ddither, int iiterations, int ttime_budget);
+
+    double quantize(const unsigned char *data, int width, int height, int stride,
+        buffer_type buf_type, const unsigned int *color_key, unsigned char *indices);
+    int size() const;
+    unsigned int color(int index) const;
+};
+
+#endif
+
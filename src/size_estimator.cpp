@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <stdint.h>
+#include <zlib.h>
+
+#include "size_estimator.h"
+#include "png_filter.h"
+
+static const int BAND_ROWS = 4;
+
+// libpng's filtering is about twice as fast as filter_row and the color
+// count, so only half of the time the sample took to filter counts.
+static const double FILTER_TIME_RATIO = 0.5;
+
+// Signature, IHDR, IEND, the zlib header and checksum.
+static const double FIXED_OVERHEAD = 8 + 25 + 12 + 6;
+
+// libpng writes an IDAT for every 8K of compressed data.
+static const double IDAT_SIZE = 8192;
+static const double IDAT_OVERHEAD = 12;
+
+// Counts the colors of a row into a small open addressing set. Returns false
+// once there are more than 256.
+static bool
+count_colors(const unsigned char *row, int width, int bpp, uint32_t *set, bool *used,
+    int &colors)
+{
+    for (int x = 0; x < width; x++, row += bpp) {
+        uint32_t c = 0;
+        memcpy(&c, row, bpp);
+        uint32_t i = (c*2654435761U) >> 23;     // 512 slots
+        while (used[i] && set[i] != c)
+            i = (i + 1) & 511;
+        if (!used[i]) {
+            if (++colors > 256)
+                return false;
+            used[i] = true;
+            set[i] = c;
+        }
+    }
+    return true;
+}
+
+void
+estimate_size(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, int bits, int level, int sample_rows, size_estimate &est)
+{
+    est.bytes = FIXED_OVERHEAD;
+    est.time = 0;
+    est.entropy = 0;
+    est.colors = 0;
+    if (width <= 0 || height <= 0)
+        return;
+
+    uint64_t start = uv_hrtime();
+
+    int bpp = bytes_per_pixel(buf_type, bits);
+    int row_len = width*bpp;
+    int bands = std::max(1, std::min(height, sample_rows)/BAND_ROWS);
+    int band_rows = std::min(height, BAND_ROWS);
+
+    std::vector<unsigned char> sample;
+    sample.reserve((size_t)bands*band_rows*(row_len + 1));
+    std::vector<unsigned char> out(row_len + 1), scratch(row_len);
+    uint32_t set[512];
+    bool used[512] = { false };
+    bool count = bits == 8;
+    int colors = 0;
+    int rows = 0;
+
+    for (int b = 0; b < bands; b++) {
+        int y0 = (int)((double)b*(height - band_rows)/std::max(1, bands - 1));
+        if (bands == 1)
+            y0 = 0;
+        for (int y = y0; y < y0 + band_rows; y++) {
+            const unsigned char *cur = data + (long)y*stride;
+            const unsigned char *prev = y > 0 ? cur - stride : NULL;
+            filter_row(cur, prev, row_len, bpp, &out[0], &scratch[0]);
+            sample.insert(sample.end(), out.begin(), out.end());
+            if (count)
+                count = count_colors(cur, width, bpp, set, used, colors);
+            rows++;
+        }
+    }
+    est.colors = count ? colors : -1;
+
+    double hist[256] = { 0 };
+    for (size_t i = 0; i < sample.size(); i++)
+        hist[sample[i]]++;
+    for (int i = 0; i < 256; i++) {
+        if (hist[i]) {
+            double p = hist[i]/sample.size();
+            est.entropy -= p*log(p)/log(2.0);
+        }
+    }
+
+    uint64_t filtered = uv_hrtime();
+    double scale = (double)height/rows;
+    uLongf len = compressBound(sample.size());
+    std::vector<unsigned char> z(len);
+    if (compress2(&z[0], &len, &sample[0], sample.size(),
+        level < 0 ? Z_DEFAULT_COMPRESSION : level) != Z_OK)
+    {
+        throw "compress2 failed in node-png (estimate_size).";
+    }
+    uint64_t deflated = uv_hrtime();
+
+    double idat = (len - 6)*scale;
+    est.bytes += idat + ceil(idat/IDAT_SIZE)*IDAT_OVERHEAD;
+    est.time = ((filtered - start)*FILTER_TIME_RATIO + (deflated - filtered))/1e6*scale;
+}
@@ -0,0 +1,21 @@
+#ifndef SIZE_ESTIMATOR_H
+#define SIZE_ESTIMATOR_H
+
+#include "common.h"
+
+struct size_estimate {
+    double bytes;       // PNG size
+    double time;        // encode time in milliseconds
+    double entropy;     // bits per byte of the filtered sample
+    int colors;         // distinct colors in the sample, -1 if over 256 or 16 bit
+};
+
+// Predicts the size and encode time of the PNG written without any reduction
+// from about sample_rows rows, taken in bands of 4 spread over the image.
+// They're filtered like libpng does and deflated with the given level, the
+// result is scaled up to the whole image. The time is what the sample took,
+// scaled the same way, so it's only as good as the machine is steady.
+void estimate_size(const unsigned char *data, int width, int height, int stride,
+    buffer_type buf_type, int bits, int level, int sample_rows, size_estimate &est);
+
+#endif
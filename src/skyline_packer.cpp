@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#include "skyline_packer.h"
+
+SkylinePacker::SkylinePacker(int bbin_width) :
+    bin_width(bbin_width), bin_height(0)
+{
+    skyline.push_back(Node(0, 0, bin_width));
+}
+
+// Returns the y at which a rectangle of width w would rest if its left edge
+// was put on skyline node i, or -1 if it would stick out of the bin.
+int
+SkylinePacker::fit(size_t i, int w) const
+{
+    if (skyline[i].x + w > bin_width)
+        return -1;
+
+    int y = 0;
+    for (int left = w; left > 0; i++) {
+        if (skyline[i].y > y)
+            y = skyline[i].y;
+        left -= skyline[i].w;
+    }
+    return y;
+}
+
+void
+SkylinePacker::add(size_t i, int x, int y, int w, int h)
+{
+    skyline.insert(skyline.begin() + i, Node(x, y + h, w));
+
+    // Shrink or drop the nodes that the new one shadows.
+    for (size_t j = i + 1; j < skyline.size(); ) {
+        int prev_end = skyline[j-1].x + skyline[j-1].w;
+        if (skyline[j].x >= prev_end)
+            break;
+        int shrink = prev_end - skyline[j].x;
+        skyline[j].x += shrink;
+        skyline[j].w -= shrink;
+        if (skyline[j].w > 0)
+            break;
+        skyline.erase(skyline.begin() + j);
+    }
+
+    // Merge neighbours at the same level.
+    for (size_t j = 0; j + 1 < skyline.size(); ) {
+        if (skyline[j].y == skyline[j+1].y) {
+            skyline[j].w += skyline[j+1].w;
+            skyline.erase(skyline.begin() + j + 1);
+        }
+        else {
+            j++;
+        }
+    }
+}
+
+Point
+SkylinePacker::insert(int w, int h)
+{
+    if (w == 0 || h == 0)
+        return Point(0, 0);
+
+    int best_top = INT_MAX, best_y = -1;
+    size_t best_i = 0;
+    for (size_t i = 0; i < skyline.size(); i++) {
+        int y = fit(i, w);
+        if (y >= 0 && y + h < best_top) {
+            best_top = y + h;
+            best_y = y;
+            best_i = i;
+        }
+    }
+    if (best_y == -1)
+        return Point(-1, -1);
+
+    int x = skyline[best_i].x;
+    add(best_i, x, best_y, w, h);
+    if (best_top > bin_height)
+        bin_height = best_top;
+    return Point(x, best_y);
+}
+
+int
+SkylinePacker::get_height() const
+{
+    return bin_height;
+}
+
+struct taller_first {
+    const std::vector<Rect> &rects;
+    taller_first(const std::vector<Rect> &rrects) : rects(rrects) {}
+    bool operator()(size_t a, size_t b) const {
+        if (rects[a].h != rects[b].h)
+            return rects[a].h > rects[b].h;
+        return rects[a].w > rects[b].w;
+    }
+};
+
+// Packs all rects, trying a few bin widths and keeping the one that gives
+// the smallest canvas. pos receives the atlas position of each rect in the
+// order they were given.
+void
+SkylinePacker::pack(const std::vector<Rect> &rects, std::vector<Point> &pos,
+    int &width, int &height)
+{
+    long area = 0;
+    int max_w = 0;
+    std::vector<size_t> order;
+    for (size_t i = 0; i < rects.size(); i++) {
+        area += (long)rects[i].w * rects[i].h;
+        if (rects[i].w > max_w)
+            max_w = rects[i].w;
+        order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), taller_first(rects));
+
+    pos.assign(rects.size(), Point(0, 0));
+    width = max_w;
+    height = 0;
+    if (max_w == 0)
+        return;
+
+    static const double factors[] = { 1.0, 1.15, 1.3, 1.6 };
+    long best_area = -1;
+    std::vector<Point> try_pos(rects.size());
+
+    for (size_t f = 0; f < sizeof(factors)/sizeof(factors[0]); f++) {
+        int bin_w = (int)ceil(sqrt((double)area) * factors[f]);
+        if (bin_w < max_w)
+            bin_w = max_w;
+
+        SkylinePacker packer(bin_w);
+        for (size_t k = 0; k < order.size(); k++) {
+            const Rect &r = rects[order[k]];
+            try_pos[order[k]] = packer.insert(r.w, r.h);
+        }
+
+        // The bin may be wider than needed, trim it to the rightmost rect.
+        int used_w = 0;
+        for (size_t i = 0; i < rects.size(); i++) {
+            if (try_pos[i].x + rects[i].w > used_w)
+                used_w = try_pos[i].x + rects[i].w;
+        }
+
+        long bin_area = (long)used_w * packer.get_height();
+        if (best_area == -1 || bin_area < best_area) {
+            best_area = bin_area;
+            pos = try_pos;
+            width = used_w;
+            height = packer.get_height();
+        }
+    }
+}
+
@@ -0,0 +1,34 @@
+#ifndef SKYLINE_PACKER_H
+#define SKYLINE_PACKER_H
+
+#include <vector>
+
+#include "common.h"
+
+// Packs rectangles into a bin of fixed width and unbounded height using the
+// skyline bottom-left heuristic.
+class SkylinePacker {
+    struct Node {
+        int x, y, w;
+        Node(int xx, int yy, int ww) : x(xx), y(yy), w(ww) {}
+    };
+
+    typedef std::vector<Node> vNode;
+    vNode skyline;
+    int bin_width, bin_height;
+
+    int fit(size_t i, int w) const;
+    void add(size_t i, int x, int y, int w, int h);
+
+public:
+    SkylinePacker(int bbin_width);
+
+    Point insert(int w, int h);
+    int get_height() const;
+
+    static void pack(const std::vector<Rect> &rects, std::vector<Point> &pos,
+        int &width, int &height);
+};
+
+#endif
+
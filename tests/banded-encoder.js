@@ -0,0 +1,40 @@
+var PngLib = require('png');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+// Two frames in bands, the second one differs only in its bottom rows. Both
+// have to decode to exactly what went in, and the second has to reuse the
+// bands above the change.
+var width = 640, height = 480, bandRows = 32;
+var session = new PngLib.EncoderSession();
+var decoder = new PngLib.PngDecoder('rgb');
+
+var frame = new Buffer(width*height*3);
+for (var i = 0; i < frame.length; i++) frame[i] = (i*13) ^ (i >> 9);
+
+function check(rgb, name) {
+    var png = new PngLib.Png(rgb, width, height, 'rgb');
+    var png_image = png.encodeSync({ session: session, bandRows: bandRows });
+    var info = png.encodeInfo();
+
+    var image = decoder.decodeSync(png_image);
+    if (image.width != width || image.height != height || image.data.length != rgb.length)
+        throw new Error(name + ' decodes to ' + image.width + 'x' + image.height);
+    for (var i = 0; i < rgb.length; i++) {
+        if (image.data[i] != rgb[i])
+            throw new Error(name + ' differs from its input at byte ' + i);
+    }
+    sys.log(name + ': ' + png_image.length + ' bytes, ' + info.bands + ' bands, ' +
+        info.bandsReused + ' reused, decodes to its input');
+    return info;
+}
+
+check(frame, 'first frame');
+
+var second = new Buffer(frame.length);
+frame.copy(second, 0, 0, frame.length);
+for (var i = (height - 10)*width*3; i < second.length; i++) second[i] = 255 - second[i];
+
+var info = check(second, 'second frame');
+if (!(info.bandsReused > 0))
+    throw new Error('no bands reused');
@@ -0,0 +1,39 @@
+var PngLib = require('png');
+var fs = require('fs');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+var pngStack = new PngLib.DynamicPngStack('rgba');
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var files = fs.readdirSync('./push-data');
+
+files.forEach(function(file) {
+    var dim = rectDim(file);
+    var rgba = fs.readFileSync('./push-data/' + file);
+    pngStack.push(rgba, dim.x, dim.y, dim.w, dim.h);
+});
+
+fs.writeFileSync('dynamic-atlas.png', pngStack.encodeAtlasSync().toString('binary'), 'binary');
+
+pngStack.placements().forEach(function (p) {
+    sys.log("(" + p.x + "," + p.y + ") " + p.width + "x" + p.height +
+        " packed at (" + p.atlasX + "," + p.atlasY + ")");
+});
+
+pngStack.encodeAtlas(function (data, placements, error) {
+    if (error) {
+        sys.log('Error: ' + error.toString());
+        return;
+    }
+    fs.writeFileSync('dynamic-atlas-async.png', data.toString('binary'), 'binary');
+    sys.log("Packed " + placements.length + " PNGs asynchronously");
+});
+
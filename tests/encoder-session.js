@@ -0,0 +1,27 @@
+var PngLib = require('png');
+var fs = require('fs');
+var sys = require('sys');
+
+var session = new PngLib.EncoderSession();
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var files = fs.readdirSync('./push-data');
+
+files.forEach(function(file, i) {
+    var dim = rectDim(file);
+    var rgba = fs.readFileSync('./push-data/' + file);
+    var png = new PngLib.Png(rgba, dim.w, dim.h, 'rgba');
+    var data = png.encodeSync({ session: session });
+    var info = png.encodeInfo();
+
+    sys.log(file + ": " + info.colorType + " (" + info.bitDepth + " bits), " +
+        data.length + " bytes, session has " + session.colors() + " colors");
+});
+
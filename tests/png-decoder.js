@@ -0,0 +1,53 @@
+var PngLib = require('png');
+var fs = require('fs');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+var width = 720, height = 400;
+var rgba = new Buffer(width*height*4);
+for (var i = 0; i < rgba.length; i++) rgba[i] = (i % 4 == 3) ? 0 : (i*7) ^ (i >> 11);
+
+var png_image = new PngLib.Png(rgba, width, height, 'rgba').encodeSync();
+var decoder = new PngLib.PngDecoder('rgba');
+
+var image = decoder.decodeSync(png_image);
+var same = image.data.length == rgba.length;
+for (var i = 0; same && i < rgba.length; i++) same = image.data[i] == rgba[i];
+sys.log('decodeSync ' + image.width + 'x' + image.height + ' ' + image.colorType +
+    ', same as encoded: ' + same);
+
+decoder.decode(png_image, function (image, error) {
+    if (error) throw error;
+    var gray = new PngLib.PngDecoder('gray').decodeSync(png_image);
+    fs.writeFileSync('./png-decoder-gray.png',
+        new PngLib.Png(gray.data, gray.width, gray.height, 'gray').encodeSync().toString('binary'),
+        'binary');
+    sys.log('decode ' + image.width + 'x' + image.height);
+
+    // push it in small pieces, like it would come off a socket
+    var rows = 0, calls = 0;
+    decoder.onheader = function (info) {
+        sys.log('header ' + info.width + 'x' + info.height + ' ' + info.colorType + ' ' +
+            info.bitDepth + ' bit, ' + info.rowBytes + ' bytes per row');
+    };
+    decoder.onrows = function (data, y, count) {
+        if (y != rows) throw new Error('rows out of order');
+        rows += count;
+        calls++;
+    };
+    decoder.onend = function (image) {
+        sys.log('push ' + rows + ' rows in ' + calls + ' calls');
+    };
+    decoder.onerror = function (error) {
+        throw error;
+    };
+    for (var pos = 0; pos < png_image.length; pos += 4096)
+        decoder.push(png_image.slice(pos, Math.min(pos + 4096, png_image.length)));
+    decoder.end();
+});
+
+var info = PngLib.Png.probe(png_image, { crc: true });
+sys.log('probe ' + info.width + 'x' + info.height + ' ' + info.colorType + ' ' +
+    info.bitDepth + ' bit, ' + info.idatBytes + ' bytes of IDAT, chunks ' + info.chunks.join(' '));
+info = PngLib.Png.probe(png_image.slice(0, 100));
+sys.log('probe of 100 bytes, complete: ' + info.complete);
@@ -0,0 +1,37 @@
+var PngLib = require('png');
+var fs = require('fs');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+var width = 720, height = 400;
+var frame = new Buffer(width*height*4);
+for (var i = 0; i < frame.length; i++) frame[i] = 0xFF;
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgba-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+var files = fs.readdirSync('./push-data');
+var rects = [];
+
+files.forEach(function(file) {
+    var dim = rectDim(file);
+    var rgba = fs.readFileSync('./push-data/' + file);
+    for (var y = 0; y < dim.h; y++) {
+        rgba.copy(frame, ((dim.y + y)*width + dim.x)*4, y*dim.w*4, (y + 1)*dim.w*4);
+    }
+    rects.push(dim);
+});
+
+PngLib.Png.encodeRegions(frame, width, height, 'rgba', rects, function (regions, error) {
+    if (error) throw error;
+    regions.forEach(function (r, i) {
+        fs.writeFileSync('region-' + i + '.png', r.png.toString('binary'), 'binary');
+        sys.log(r.x + ',' + r.y + ' ' + r.w + 'x' + r.h + ': ' +
+            r.png.length + ' bytes in ' + r.time.toFixed(2) + 'ms');
+    });
+});
@@ -0,0 +1,44 @@
+var PngLib = require('png');
+var fs = require('fs');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+var width = 4000, height = 4000, rows = 50;
+var out = fs.createWriteStream('./png-encode-stream.png');
+var stream = PngLib.Png.createEncodeStream(width, height, 'rgb');
+var y = 0;
+
+function band(y0) {
+    var buf = new Buffer(width*rows*3);
+    for (var i = 0; i < buf.length; i++)
+        buf[i] = ((y0 + Math.floor(i/(width*3)))*3 + i%(width*3)) & 0xFF;
+    return buf;
+}
+
+function more() {
+    while (y < height) {
+        var room = stream.write(band(y));
+        y += rows;
+        if (!room) return;
+    }
+    stream.end();
+}
+
+stream.ondata = function (chunk) {
+    out.write(chunk);
+};
+stream.ondrain = more;
+stream.onend = function (info) {
+    out.end();
+    sys.log('Wrote ' + width + 'x' + height + ' ' + info.colorType);
+};
+stream.onerror = function (error) {
+    throw error;
+};
+
+more();
+
+// Dropped half written, it mustn't keep node from exiting once the one
+// above is done.
+var dropped = PngLib.Png.createEncodeStream(width, height, 'rgb');
+dropped.write(band(0));
@@ -0,0 +1,38 @@
+var PngLib = require('png');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+// Estimated against actual size and time, for a few kinds of content.
+var width = 1280, height = 720;
+var kinds = {
+    gradient: function (x, y) { return [x & 255, y & 255, (x + y) & 255]; },
+    noise: function (x, y) { return [Math.random()*256, Math.random()*256, Math.random()*256]; },
+    text: function (x, y) {
+        var ink = ((x >> 3) + (y >> 4)) % 7 == 0 && (x*y) % 5 < 2;
+        return ink ? [0, 0, 0] : [255, 255, 255];
+    },
+    blocks: function (x, y) { return [(x/40|0)*13, (y/30|0)*17, ((x ^ y) & 4) ? 90 : 10]; }
+};
+
+for (var kind in kinds) {
+    var rgb = new Buffer(width*height*3);
+    for (var y = 0; y < height; y++) {
+        for (var x = 0; x < width; x++) {
+            var p = kinds[kind](x, y), i = (y*width + x)*3;
+            rgb[i] = p[0]; rgb[i+1] = p[1]; rgb[i+2] = p[2];
+        }
+    }
+
+    var png = new PngLib.Png(rgb, width, height, 'rgb');
+    [1, 6, 9].forEach(function (level) {
+        var est = png.estimate({ level: level });
+        var start = Date.now();
+        var png_image = png.encodeSync({ level: level });
+        var time = Date.now() - start;
+        sys.log(kind + ' level ' + level + ': ' + png_image.length + ' bytes in ' + time +
+            'ms, estimated ' + est.bytes + ' bytes (' +
+            Math.round((est.bytes/png_image.length - 1)*100) + '%) in ' +
+            Math.round(est.time) + 'ms, entropy ' + est.entropy.toFixed(2) +
+            ', colors ' + est.colors);
+    });
+}
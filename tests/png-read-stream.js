@@ -0,0 +1,28 @@
+var PngLib = require('png');
+var fs = require('fs');
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+var width = 2000, height = 2000;
+var rgb = new Buffer(width*height*3);
+for (var i = 0; i < rgb.length; i++) rgb[i] = (i*7) ^ (i >> 11);
+
+var png = new PngLib.Png(rgb, width, height, 'rgb');
+var out = fs.createWriteStream('./png-read-stream.png');
+var chunks = 0;
+
+var stream = png.createReadStream({ chunkSize: 16384 });
+stream.ondata = function (chunk) {
+    chunks++;
+    if (!out.write(chunk)) {
+        stream.pause();
+        out.once('drain', function () { stream.resume(); });
+    }
+};
+stream.onend = function (info) {
+    out.end();
+    sys.log(chunks + ' chunks, ' + info.colorType + ' ' + info.bitDepth + ' bit');
+};
+stream.onerror = function (error) {
+    throw error;
+};